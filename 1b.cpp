@@ -1,3 +1,6 @@
+// Included by the mode and tool files (1c.cpp ...), some of them together.
+#ifndef SM4_OPT_INCLUDED
+#define SM4_OPT_INCLUDED
 #include <iostream>
 #include <iomanip>
 #include <cstring>
@@ -5,37 +8,149 @@
 #include <wmmintrin.h>
 #include <array>
 #include <vector>
-#include <1a.cpp>
-class SM4_TTable {
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#define SM4_BASIC_NO_MAIN
+#include "1a.cpp"
+
+typedef SM4 SM4_Basic;
+static const int ROUNDS = 32;
+
+// The SIMD backends are compiled with per-function target attributes
+// instead of global -m flags, so a generic build still carries them and
+// SM4_Dispatch decides at run time which one the host can execute.
+#if defined(__x86_64__) || defined(__i386__)
+#define SM4_HAVE_X86 1
+#define SM4_TARGET_AESNI __attribute__((target("aes,ssse3")))
+#define SM4_TARGET_AESNI_AVX2 __attribute__((target("aes,avx2")))
+#define SM4_TARGET_GFNI_AVX512 __attribute__((target("gfni,avx512f,avx512bw")))
+#define SM4_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+static constexpr uint32_t sm4_rotl(uint32_t x, int n) {
+    return (x << n) | (x >> (32 - n));
+}
+
+// T[k][x] = L(S(x) << (24 - 8k)): S-box and linear transform of one input
+// byte in one step. Generated at compile time from the S-box, so the tables
+// sit in .rodata and constructing a context costs nothing.
+struct SM4_TTables {
+    uint32_t T[4][256];
+};
+
+static constexpr SM4_TTables sm4_make_ttables() {
+    SM4_TTables t = {};
+    for (int i = 0; i < 256; i++) {
+        uint32_t b = (uint32_t)SM4_S_BOX[i] << 24;
+        t.T[0][i] = b ^ sm4_rotl(b, 2) ^ sm4_rotl(b, 10) ^ sm4_rotl(b, 18) ^ sm4_rotl(b, 24);
+        t.T[1][i] = sm4_rotl(t.T[0][i], 24);
+        t.T[2][i] = sm4_rotl(t.T[0][i], 16);
+        t.T[3][i] = sm4_rotl(t.T[0][i], 8);
+    }
+    return t;
+}
+
+alignas(64) static constexpr SM4_TTables SM4_T = sm4_make_ttables();
+
+// Table-driven SM4. NTables = 4 uses the four 1 KB tables (4 KB working
+// set); NTables = 1 only reads T[0] and applies the byte rotations of
+// T[1..3] in registers, so it keeps 1 KB in L1 when the cipher shares the
+// core with other hot code.
+template <int NTables>
+class SM4_TTableT {
 private:
-    static const uint8_t S_BOX[256];
-    static const uint32_t FK[4];
-    static const uint32_t CK[32];
+    static_assert(NTables == 1 || NTables == 4, "SM4_TTableT: 1 or 4 tables");
 
     uint32_t rk[ROUNDS];
-    uint32_t T[4][256]; // T-table
 
-    void init_T_table() {
-        for (int i = 0; i < 256; i++) {
-            uint32_t a = S_BOX[i];
-            uint32_t b = (a << 24) | (a << 16) | (a << 8) | a;
-            T[0][i] = b ^ rotate_left(b, 2) ^ rotate_left(b, 10) ^ rotate_left(b, 18) ^ rotate_left(b, 24);
-            T[1][i] = rotate_left(T[0][i], 24);
-            T[2][i] = rotate_left(T[0][i], 16);
-            T[3][i] = rotate_left(T[0][i], 8);
+    static uint32_t rotate_left(uint32_t x, uint8_t n) {
+        return (x << n) | (x >> (32 - n));
+    }
+
+    static uint32_t tau(uint32_t x) {
+        return ((uint32_t)SM4_S_BOX[x >> 24] << 24) | ((uint32_t)SM4_S_BOX[(x >> 16) & 0xFF] << 16) |
+            ((uint32_t)SM4_S_BOX[(x >> 8) & 0xFF] << 8) | SM4_S_BOX[x & 0xFF];
+    }
+
+    static uint32_t T_lookup(uint32_t x) {
+        const uint32_t (&T)[4][256] = SM4_T.T;
+        if (NTables == 4) {
+            return T[0][x >> 24] ^ T[1][(x >> 16) & 0xFF] ^ T[2][(x >> 8) & 0xFF] ^ T[3][x & 0xFF];
         }
+        return T[0][x >> 24] ^ rotate_left(T[0][(x >> 16) & 0xFF], 24) ^
+            rotate_left(T[0][(x >> 8) & 0xFF], 16) ^ rotate_left(T[0][x & 0xFF], 8);
     }
 
-    uint32_t rotate_left(uint32_t x, uint8_t n) {
-        return (x << n) | (x >> (32 - n));
+    // Round key r of block b: one schedule for every block, or one schedule
+    // per block taken from a slab of schedules (multi-session batches).
+    struct OneKey {
+        const uint32_t* rk;
+        uint32_t operator()(int, int r) const { return rk[r]; }
+        OneKey at(size_t) const { return *this; }
+    };
+
+    struct LaneKeys {
+        const uint32_t* slab;
+        const uint32_t* off;
+        uint32_t operator()(int b, int r) const { return slab[off[b] + r]; }
+        LaneKeys at(size_t b) const { return LaneKeys{ slab, off + b }; }
+    };
+
+    // N independent blocks go through the rounds side by side, so the
+    // 4*N table lookups of one round do not wait on each other.
+    template <int N, bool Dec, class Keys>
+    void crypt_nblocks(const Keys& keys, const uint8_t* in, uint8_t* out) {
+        uint32_t X0[N], X1[N], X2[N], X3[N];
+        for (int b = 0; b < N; ++b) {
+            const uint8_t* p = in + b * 16;
+            X0[b] = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+            X1[b] = (p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+            X2[b] = (p[8] << 24) | (p[9] << 16) | (p[10] << 8) | p[11];
+            X3[b] = (p[12] << 24) | (p[13] << 16) | (p[14] << 8) | p[15];
+        }
+
+        for (int i = 0; i < ROUNDS; i += 4) {
+            const int r0 = Dec ? ROUNDS - 1 - i : i;
+            const int r1 = Dec ? r0 - 1 : r0 + 1;
+            const int r2 = Dec ? r0 - 2 : r0 + 2;
+            const int r3 = Dec ? r0 - 3 : r0 + 3;
+            for (int b = 0; b < N; ++b) X0[b] ^= T_lookup(X1[b] ^ X2[b] ^ X3[b] ^ keys(b, r0));
+            for (int b = 0; b < N; ++b) X1[b] ^= T_lookup(X2[b] ^ X3[b] ^ X0[b] ^ keys(b, r1));
+            for (int b = 0; b < N; ++b) X2[b] ^= T_lookup(X3[b] ^ X0[b] ^ X1[b] ^ keys(b, r2));
+            for (int b = 0; b < N; ++b) X3[b] ^= T_lookup(X0[b] ^ X1[b] ^ X2[b] ^ keys(b, r3));
+        }
+
+        for (int b = 0; b < N; ++b) {
+            const uint32_t Y[4] = { X3[b], X2[b], X1[b], X0[b] };
+            for (int i = 0; i < 4; ++i) {
+                out[b * 16 + i * 4] = (Y[i] >> 24) & 0xFF;
+                out[b * 16 + i * 4 + 1] = (Y[i] >> 16) & 0xFF;
+                out[b * 16 + i * 4 + 2] = (Y[i] >> 8) & 0xFF;
+                out[b * 16 + i * 4 + 3] = Y[i] & 0xFF;
+            }
+        }
     }
 
-public:
-    SM4_TTable() {
-        init_T_table();
+    template <bool Dec, class Keys>
+    void crypt_blocks(Keys keys, const uint8_t* in, uint8_t* out, size_t nblocks) {
+        for (; nblocks >= 8; nblocks -= 8, in += 128, out += 128, keys = keys.at(8))
+            crypt_nblocks<8, Dec>(keys, in, out);
+        if (nblocks >= 4) {
+            crypt_nblocks<4, Dec>(keys, in, out);
+            nblocks -= 4; in += 64; out += 64; keys = keys.at(4);
+        }
+        for (; nblocks > 0; --nblocks, in += 16, out += 16, keys = keys.at(1))
+            crypt_nblocks<1, Dec>(keys, in, out);
     }
 
-    void set_key(const uint8_t key[16]) {
+public:
+    // Round keys of one key, in encryption order. The schedule is the same
+    // for every backend, so it can be computed once and fed to any of them.
+    static void expand_key(const uint8_t key[16], uint32_t rk[ROUNDS]) {
         uint32_t K[4];
         for (int i = 0; i < 4; ++i) {
             K[i] = (key[i * 4] << 24) | (key[i * 4 + 1] << 16) |
@@ -43,27 +158,45 @@ public:
         }
 
         for (int i = 0; i < 4; ++i) {
-            K[i] ^= FK[i];
+            K[i] ^= SM4_FK[i];
         }
 
         for (int i = 0; i < ROUNDS; ++i) {
-            uint32_t T_val = K[(i + 1) % 4] ^ K[(i + 2) % 4] ^ K[(i + 3) % 4] ^ CK[i];
-
-         
-            uint32_t B = (T_val >> 24) & 0xFF;
-            uint32_t result = T[0][B];
-            B = (T_val >> 16) & 0xFF;
-            result ^= T[1][B];
-            B = (T_val >> 8) & 0xFF;
-            result ^= T[2][B];
-            B = T_val & 0xFF;
-            result ^= T[3][B];
+            uint32_t T_val = K[(i + 1) % 4] ^ K[(i + 2) % 4] ^ K[(i + 3) % 4] ^ SM4_CK[i];
+
+            // the key schedule uses L', so only the bare S-box applies here
+            uint32_t result = tau(T_val);
 
             rk[i] = K[i % 4] ^ (result ^ rotate_left(result, 13) ^ rotate_left(result, 23));
             K[i % 4] = rk[i];
         }
     }
 
+    void set_key(const uint8_t key[16]) {
+        expand_key(key, rk);
+    }
+
+    // Bulk ECB over n consecutive 16-byte blocks.
+    void encrypt_blocks(const uint8_t* in, uint8_t* out, size_t nblocks) {
+        crypt_blocks<false>(OneKey{ rk }, in, out, nblocks);
+    }
+
+    void decrypt_blocks(const uint8_t* in, uint8_t* out, size_t nblocks) {
+        crypt_blocks<true>(OneKey{ rk }, in, out, nblocks);
+    }
+
+    // Bulk ECB where block b uses the schedule at slab + off[b] (ROUNDS words,
+    // encryption order), so blocks of many sessions can share one call.
+    void encrypt_blocks_multikey(const uint32_t* slab, const uint32_t* off,
+        const uint8_t* in, uint8_t* out, size_t nblocks) {
+        crypt_blocks<false>(LaneKeys{ slab, off }, in, out, nblocks);
+    }
+
+    void decrypt_blocks_multikey(const uint32_t* slab, const uint32_t* off,
+        const uint8_t* in, uint8_t* out, size_t nblocks) {
+        crypt_blocks<true>(LaneKeys{ slab, off }, in, out, nblocks);
+    }
+
     void encrypt(const uint8_t in[16], uint8_t out[16]) {
         uint32_t X[36];
         for (int i = 0; i < 4; ++i) {
@@ -73,18 +206,7 @@ public:
 
         for (int i = 0; i < ROUNDS; ++i) {
             uint32_t T_val = X[i + 1] ^ X[i + 2] ^ X[i + 3] ^ rk[i];
-
-     
-            uint32_t B = (T_val >> 24) & 0xFF;
-            uint32_t result = T[0][B];
-            B = (T_val >> 16) & 0xFF;
-            result ^= T[1][B];
-            B = (T_val >> 8) & 0xFF;
-            result ^= T[2][B];
-            B = T_val & 0xFF;
-            result ^= T[3][B];
-
-            X[i + 4] = X[i] ^ result;
+            X[i + 4] = X[i] ^ T_lookup(T_val);
         }
 
         for (int i = 0; i < 4; ++i) {
@@ -104,18 +226,7 @@ public:
 
         for (int i = 0; i < ROUNDS; ++i) {
             uint32_t T_val = X[i + 1] ^ X[i + 2] ^ X[i + 3] ^ rk[ROUNDS - 1 - i];
-
-            
-            uint32_t B = (T_val >> 24) & 0xFF;
-            uint32_t result = T[0][B];
-            B = (T_val >> 16) & 0xFF;
-            result ^= T[1][B];
-            B = (T_val >> 8) & 0xFF;
-            result ^= T[2][B];
-            B = T_val & 0xFF;
-            result ^= T[3][B];
-
-            X[i + 4] = X[i] ^ result;
+            X[i + 4] = X[i] ^ T_lookup(T_val);
         }
 
         for (int i = 0; i < 4; ++i) {
@@ -127,238 +238,1824 @@ public:
     }
 };
 
+typedef SM4_TTableT<4> SM4_TTable;
+typedef SM4_TTableT<1> SM4_TTable1K;
+
+
+// out = a ^ b over n bytes, 8 bytes at a time; out may alias a.
+static inline void sm4_xor(uint8_t* out, const uint8_t* a, const uint8_t* b, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        x ^= y;
+        memcpy(out + i, &x, 8);
+    }
+    for (; i < n; ++i) {
+        out[i] = a[i] ^ b[i];
+    }
+}
+
+// One fragment of a scatter-gather request: len bytes are read from in and
+// written to out. out may equal in for in-place processing; fragments can
+// have any length and blocks may straddle fragment boundaries.
+struct SM4_IoVec {
+    const uint8_t* in;
+    uint8_t* out;
+    size_t len;
+};
+
+static inline size_t sm4_iov_len(const SM4_IoVec* iov, size_t iovcnt) {
+    size_t len = 0;
+    for (size_t i = 0; i < iovcnt; ++i) {
+        len += iov[i].len;
+    }
+    return len;
+}
+
+// Walks a fragment chain. consume(n, fn) advances by n bytes and calls
+// fn(in, out, len, pos) once per contiguous piece, pos being the offset of
+// the piece within those n bytes; nothing is linearized.
+class SM4_IoCursor {
+public:
+    SM4_IoCursor(const SM4_IoVec* iov, size_t iovcnt) : iov(iov), iovcnt(iovcnt), idx(0), off(0) {
+    }
+
+    template <class Fn>
+    void consume(size_t n, Fn&& fn) {
+        for (size_t pos = 0; pos < n && idx < iovcnt;) {
+            const SM4_IoVec& v = iov[idx];
+            size_t m = v.len - off < n - pos ? v.len - off : n - pos;
+            if (m > 0) fn(v.in + off, v.out + off, m, pos);
+            pos += m;
+            off += m;
+            if (off == v.len) {
+                ++idx;
+                off = 0;
+            }
+        }
+    }
+
+private:
+    const SM4_IoVec* iov;
+    size_t iovcnt;
+    size_t idx, off;
+};
+
+// Generates len bytes of CTR keystream in batches and passes each batch to
+// sink(ks, n). ctr is the initial counter block (nonce || counter),
+// incremented as a 128-bit big-endian integer; on return it holds the next
+// unused counter.
+template <class Cipher, class Sink>
+void sm4_ctr_keystream(Cipher& cipher, uint8_t ctr[16], size_t len, Sink&& sink) {
+    // one full batch of the widest (bitsliced) kernel
+    const size_t BATCH = 256;
+    alignas(64) uint8_t ctrs[BATCH * 16];
+    alignas(64) uint8_t ks[BATCH * 16];
+
+    uint64_t hi, lo;
+    memcpy(&hi, ctr, 8);
+    memcpy(&lo, ctr + 8, 8);
+    hi = __builtin_bswap64(hi);
+    lo = __builtin_bswap64(lo);
+
+    while (len > 0) {
+        size_t nblocks = (len + 15) / 16;
+        if (nblocks > BATCH) nblocks = BATCH;
+
+        for (size_t b = 0; b < nblocks; ++b) {
+            uint64_t be_hi = __builtin_bswap64(hi), be_lo = __builtin_bswap64(lo);
+            memcpy(ctrs + b * 16, &be_hi, 8);
+            memcpy(ctrs + b * 16 + 8, &be_lo, 8);
+            if (++lo == 0) ++hi;
+        }
+        cipher.encrypt_blocks(ctrs, ks, nblocks);
+
+        size_t n = nblocks * 16 < len ? nblocks * 16 : len;
+        sink(ks, n);
+        len -= n;
+    }
+
+    hi = __builtin_bswap64(hi);
+    lo = __builtin_bswap64(lo);
+    memcpy(ctr, &hi, 8);
+    memcpy(ctr + 8, &lo, 8);
+}
+
+// CTR mode on top of any engine with encrypt_blocks(). On return ctr holds
+// the next unused counter so a stream can be continued with further calls
+// as long as each call covers whole blocks.
+template <class Cipher>
+void sm4_ctr_crypt(Cipher& cipher, uint8_t ctr[16], const uint8_t* in, uint8_t* out, size_t len) {
+    sm4_ctr_keystream(cipher, ctr, len, [&](const uint8_t* ks, size_t n) {
+        sm4_xor(out, in, ks, n);
+        in += n;
+        out += n;
+    });
+}
+
+// Scatter-gather CTR: the fragments are treated as one contiguous message,
+// so the keystream of a block split across fragments continues seamlessly.
+template <class Cipher>
+void sm4_ctr_crypt_iov(Cipher& cipher, uint8_t ctr[16], const SM4_IoVec* iov, size_t iovcnt) {
+    SM4_IoCursor cur(iov, iovcnt);
+    sm4_ctr_keystream(cipher, ctr, sm4_iov_len(iov, iovcnt), [&](const uint8_t* ks, size_t n) {
+        cur.consume(n, [&](const uint8_t* in, uint8_t* out, size_t m, size_t pos) {
+            sm4_xor(out, in, ks + pos, m);
+        });
+    });
+}
+
+
+// CBC encryption of one stream is inherently serial; iv is updated to the
+// last ciphertext block so the stream can be continued.
+template <class Cipher>
+void sm4_cbc_encrypt(Cipher& cipher, uint8_t iv[16], const uint8_t* in, uint8_t* out, size_t nblocks) {
+    for (size_t b = 0; b < nblocks; ++b) {
+        sm4_xor(out + b * 16, in + b * 16, iv, 16);
+        cipher.encrypt(out + b * 16, out + b * 16);
+        memcpy(iv, out + b * 16, 16);
+    }
+}
+
+// CBC decryption has no chaining on the cipher side: a batch of ciphertext
+// blocks goes through decrypt_blocks (8/16 lanes on the SIMD backends) and the
+// previous ciphertext blocks are XORed in afterwards. The XOR runs backwards
+// so that in == out works.
+template <class Cipher>
+void sm4_cbc_decrypt(Cipher& cipher, uint8_t iv[16], const uint8_t* in, uint8_t* out, size_t nblocks) {
+    const size_t BATCH = 256;
+    alignas(64) uint8_t tmp[BATCH * 16];
+    uint8_t next_iv[16];
+
+    while (nblocks > 0) {
+        size_t n = nblocks < BATCH ? nblocks : BATCH;
+        cipher.decrypt_blocks(in, tmp, n);
+        memcpy(next_iv, in + (n - 1) * 16, 16);
+        for (size_t b = n - 1; b > 0; --b) {
+            sm4_xor(out + b * 16, tmp + b * 16, in + (b - 1) * 16, 16);
+        }
+        sm4_xor(out, tmp, iv, 16);
+        memcpy(iv, next_iv, 16);
+        in += n * 16; out += n * 16; nblocks -= n;
+    }
+}
+
+// One of several independent CBC chains under the same key. out may be
+// nullptr for CBC-MAC, in which case only the chaining value is kept; on
+// return iv holds the last ciphertext block (the MAC).
+struct SM4_CbcStream {
+    uint8_t iv[16];
+    const uint8_t* in;
+    uint8_t* out;
+    size_t nblocks;
+};
+
+// CBC encryption / CBC-MAC over many streams at once: block j of every
+// stream that is still active is gathered into one batch, so independent
+// chains fill the SIMD lanes that a single chain leaves idle.
+template <class Cipher>
+void sm4_cbc_encrypt_streams(Cipher& cipher, SM4_CbcStream* streams, size_t nstreams) {
+    const size_t BATCH = 64;
+    alignas(64) uint8_t buf[BATCH * 16];
+    size_t active[BATCH];
+
+    for (size_t first = 0; first < nstreams; first += BATCH) {
+        size_t group = nstreams - first < BATCH ? nstreams - first : BATCH;
+        for (size_t j = 0;; ++j) {
+            size_t n = 0;
+            for (size_t k = 0; k < group; ++k) {
+                SM4_CbcStream& st = streams[first + k];
+                if (j < st.nblocks) {
+                    sm4_xor(buf + n * 16, st.in + j * 16, st.iv, 16);
+                    active[n++] = first + k;
+                }
+            }
+            if (n == 0) break;
+            cipher.encrypt_blocks(buf, buf, n);
+            for (size_t k = 0; k < n; ++k) {
+                SM4_CbcStream& st = streams[active[k]];
+                memcpy(st.iv, buf + k * 16, 16);
+                if (st.out != nullptr) memcpy(st.out + j * 16, buf + k * 16, 16);
+            }
+        }
+    }
+}
+
+// Raw CBC-MAC (zero IV, last block) over whole blocks. Only secure for
+// messages of one fixed length; padding and length binding are the caller's.
+template <class Cipher>
+void sm4_cbc_mac(Cipher& cipher, const uint8_t* in, size_t nblocks, uint8_t mac[16]) {
+    SM4_CbcStream st = {};
+    st.in = in;
+    st.nblocks = nblocks;
+    sm4_cbc_encrypt_streams(cipher, &st, 1);
+    memcpy(mac, st.iv, 16);
+}
+
+
+// Host features relevant to SM4, probed once via CPUID (__builtin_cpu_supports
+// also checks that the OS saves the ymm/zmm state).
+struct SM4_CpuInfo {
+    bool aesni;
+    bool pclmul;
+    bool avx2;
+    bool gfni_avx512;
+};
+
+static const SM4_CpuInfo& sm4_cpu() {
+    static const SM4_CpuInfo info = [] {
+        SM4_CpuInfo c = { false, false, false, false };
+#ifdef SM4_HAVE_X86
+        __builtin_cpu_init();
+        c.aesni = __builtin_cpu_supports("aes") && __builtin_cpu_supports("ssse3");
+        c.pclmul = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+        c.avx2 = __builtin_cpu_supports("avx2");
+        c.gfni_avx512 = __builtin_cpu_supports("gfni") && __builtin_cpu_supports("avx512f") &&
+            __builtin_cpu_supports("avx512bw");
+#endif
+        return c;
+    }();
+    return info;
+}
+
 
-#ifdef __AES__
+#ifdef SM4_HAVE_X86
+// SM4 on AES-NI. Both S-boxes are an inversion in GF(2^8) wrapped in affine
+// maps, so S_sm4(x) = post(AESENCLAST(pre(x), 0)), where pre/post carry the
+// SM4 affine transforms, the field isomorphism and the AES affine undo. Each
+// of them is applied as two 16-entry nibble lookups with PSHUFB.
+// Blocks are processed transposed (one register per state word): 4 blocks
+// per xmm, 8 per ymm when AVX2 is available.
 class SM4_AESNI {
 private:
-    __m128i rk[32];
-    static const uint8_t S_BOX[256];
-    static const uint32_t FK[4];
-    static const uint32_t CK[32];
+    uint32_t rk[ROUNDS];
+    bool use_avx2;
 
-    __m128i sm4_sbox_aesni(__m128i x) {
-   
-        x = _mm_aesenc_si128(x, _mm_setzero_si128());
+    // Round-key vectors for the transposed state, where lane b is block b:
+    // a broadcast of one schedule, or per-lane words gathered from a slab.
+    struct OneKey {
+        const uint32_t* rk;
+        SM4_TARGET_AESNI __m128i x4(int r) const { return _mm_set1_epi32((int)rk[r]); }
+        SM4_TARGET_AESNI_AVX2 __m256i x8(int r) const { return _mm256_set1_epi32((int)rk[r]); }
+        OneKey at(size_t) const { return *this; }
+        OneKey padded(size_t, uint32_t*) const { return *this; }
+    };
+
+    struct LaneKeys {
+        const uint32_t* slab;
+        const uint32_t* off;
+        SM4_TARGET_AESNI __m128i x4(int r) const {
+            return _mm_setr_epi32((int)slab[off[0] + r], (int)slab[off[1] + r],
+                (int)slab[off[2] + r], (int)slab[off[3] + r]);
+        }
+        SM4_TARGET_AESNI_AVX2 __m256i x8(int r) const {
+            __m256i idx = _mm256_add_epi32(_mm256_loadu_si256((const __m256i*)off), _mm256_set1_epi32(r));
+            return _mm256_i32gather_epi32((const int*)slab, idx, 4);
+        }
+        LaneKeys at(size_t b) const { return LaneKeys{ slab, off + b }; }
+        // offsets for a zero-padded tail of n blocks; unused lanes reuse block 0's key
+        LaneKeys padded(size_t n, uint32_t* buf) const {
+            for (size_t b = 0; b < 4; ++b) buf[b] = off[b < n ? b : 0];
+            return LaneKeys{ slab, buf };
+        }
+    };
+
+    SM4_TARGET_AESNI static __m128i affine(__m128i x, __m128i lo_t, __m128i hi_t) {
+        const __m128i mask = _mm_set1_epi8(0x0F);
+        __m128i lo = _mm_shuffle_epi8(lo_t, _mm_and_si128(x, mask));
+        __m128i hi = _mm_shuffle_epi8(hi_t, _mm_and_si128(_mm_srli_epi32(x, 4), mask));
+        return _mm_xor_si128(lo, hi);
+    }
+
+    // S-box on every byte; the result is still permuted by ShiftRows.
+    SM4_TARGET_AESNI static __m128i sbox_shifted(__m128i x) {
+        x = affine(x, _mm_set_epi64x(0x9814A8241D912DA1, 0x078B37BB820EB23E),
+            _mm_set_epi64x(0x3FE311CDFA26D408, 0x37EB19C5F22EDC00));
         x = _mm_aesenclast_si128(x, _mm_setzero_si128());
-        return x;
+        return affine(x, _mm_set_epi64x(0x47FF8D3579C1B30B, 0x2098EA521EA6D46C),
+            _mm_set_epi64x(0xED0DBD5D709020C0, 0x2DCD7D9DB050E000));
+    }
+
+    // x0 ^ L(S(t)); undoing ShiftRows is folded into the byte rotations of L.
+    SM4_TARGET_AESNI static __m128i round_f(__m128i x0, __m128i t) {
+        __m128i x = sbox_shifted(t);
+        __m128i a = _mm_shuffle_epi8(x, _mm_setr_epi8(0, 13, 10, 7, 4, 1, 14, 11, 8, 5, 2, 15, 12, 9, 6, 3));
+        __m128i r8 = _mm_shuffle_epi8(x, _mm_setr_epi8(7, 0, 13, 10, 11, 4, 1, 14, 15, 8, 5, 2, 3, 12, 9, 6));
+        __m128i r16 = _mm_shuffle_epi8(x, _mm_setr_epi8(10, 7, 0, 13, 14, 11, 4, 1, 2, 15, 8, 5, 6, 3, 12, 9));
+        __m128i r24 = _mm_shuffle_epi8(x, _mm_setr_epi8(13, 10, 7, 0, 1, 14, 11, 4, 5, 2, 15, 8, 9, 6, 3, 12));
+        __m128i u = _mm_xor_si128(_mm_xor_si128(a, r8), r16);
+        u = _mm_or_si128(_mm_slli_epi32(u, 2), _mm_srli_epi32(u, 30));
+        return _mm_xor_si128(_mm_xor_si128(x0, a), _mm_xor_si128(r24, u));
+    }
+
+    // 4x4 transpose of 32-bit words: s_i[b] <-> b_b[i]
+    SM4_TARGET_AESNI static void transpose(__m128i& a, __m128i& b, __m128i& c, __m128i& d) {
+        __m128i t0 = _mm_unpacklo_epi32(a, b), t1 = _mm_unpacklo_epi32(c, d);
+        __m128i t2 = _mm_unpackhi_epi32(a, b), t3 = _mm_unpackhi_epi32(c, d);
+        a = _mm_unpacklo_epi64(t0, t1); b = _mm_unpackhi_epi64(t0, t1);
+        c = _mm_unpacklo_epi64(t2, t3); d = _mm_unpackhi_epi64(t2, t3);
+    }
+
+    template <bool Dec, class Keys>
+    SM4_TARGET_AESNI static void crypt4(const Keys& keys, const uint8_t* in, uint8_t* out) {
+        const __m128i bswap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+        __m128i s0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in)), bswap);
+        __m128i s1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + 16)), bswap);
+        __m128i s2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + 32)), bswap);
+        __m128i s3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + 48)), bswap);
+        transpose(s0, s1, s2, s3);
+
+        for (int i = 0; i < ROUNDS; i += 4) {
+            const __m128i k0 = keys.x4(Dec ? ROUNDS - 1 - i : i);
+            const __m128i k1 = keys.x4(Dec ? ROUNDS - 2 - i : i + 1);
+            const __m128i k2 = keys.x4(Dec ? ROUNDS - 3 - i : i + 2);
+            const __m128i k3 = keys.x4(Dec ? ROUNDS - 4 - i : i + 3);
+            s0 = round_f(s0, _mm_xor_si128(_mm_xor_si128(s1, s2), _mm_xor_si128(s3, k0)));
+            s1 = round_f(s1, _mm_xor_si128(_mm_xor_si128(s2, s3), _mm_xor_si128(s0, k1)));
+            s2 = round_f(s2, _mm_xor_si128(_mm_xor_si128(s3, s0), _mm_xor_si128(s1, k2)));
+            s3 = round_f(s3, _mm_xor_si128(_mm_xor_si128(s0, s1), _mm_xor_si128(s2, k3)));
+        }
+
+        transpose(s3, s2, s1, s0);
+        _mm_storeu_si128((__m128i*)(out), _mm_shuffle_epi8(s3, bswap));
+        _mm_storeu_si128((__m128i*)(out + 16), _mm_shuffle_epi8(s2, bswap));
+        _mm_storeu_si128((__m128i*)(out + 32), _mm_shuffle_epi8(s1, bswap));
+        _mm_storeu_si128((__m128i*)(out + 48), _mm_shuffle_epi8(s0, bswap));
+    }
+
+    // Same round on ymm: the low lane carries blocks 0-3, the high lane 4-7.
+    SM4_TARGET_AESNI_AVX2 static __m256i affine(__m256i x, __m128i lo_t, __m128i hi_t) {
+        const __m256i mask = _mm256_set1_epi8(0x0F);
+        __m256i lo = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(lo_t), _mm256_and_si256(x, mask));
+        __m256i hi = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(hi_t),
+            _mm256_and_si256(_mm256_srli_epi32(x, 4), mask));
+        return _mm256_xor_si256(lo, hi);
+    }
+
+    SM4_TARGET_AESNI_AVX2 static __m256i sbox_shifted(__m256i x) {
+        x = affine(x, _mm_set_epi64x(0x9814A8241D912DA1, 0x078B37BB820EB23E),
+            _mm_set_epi64x(0x3FE311CDFA26D408, 0x37EB19C5F22EDC00));
+#ifdef __VAES__
+        x = _mm256_aesenclast_epi128(x, _mm256_setzero_si256());
+#else
+        __m128i lo = _mm_aesenclast_si128(_mm256_castsi256_si128(x), _mm_setzero_si128());
+        __m128i hi = _mm_aesenclast_si128(_mm256_extracti128_si256(x, 1), _mm_setzero_si128());
+        x = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+#endif
+        return affine(x, _mm_set_epi64x(0x47FF8D3579C1B30B, 0x2098EA521EA6D46C),
+            _mm_set_epi64x(0xED0DBD5D709020C0, 0x2DCD7D9DB050E000));
+    }
+
+    SM4_TARGET_AESNI_AVX2 static __m256i round_f(__m256i x0, __m256i t) {
+        __m256i x = sbox_shifted(t);
+        __m256i a = _mm256_shuffle_epi8(x, _mm256_broadcastsi128_si256(
+            _mm_setr_epi8(0, 13, 10, 7, 4, 1, 14, 11, 8, 5, 2, 15, 12, 9, 6, 3)));
+        __m256i r8 = _mm256_shuffle_epi8(x, _mm256_broadcastsi128_si256(
+            _mm_setr_epi8(7, 0, 13, 10, 11, 4, 1, 14, 15, 8, 5, 2, 3, 12, 9, 6)));
+        __m256i r16 = _mm256_shuffle_epi8(x, _mm256_broadcastsi128_si256(
+            _mm_setr_epi8(10, 7, 0, 13, 14, 11, 4, 1, 2, 15, 8, 5, 6, 3, 12, 9)));
+        __m256i r24 = _mm256_shuffle_epi8(x, _mm256_broadcastsi128_si256(
+            _mm_setr_epi8(13, 10, 7, 0, 1, 14, 11, 4, 5, 2, 15, 8, 9, 6, 3, 12)));
+        __m256i u = _mm256_xor_si256(_mm256_xor_si256(a, r8), r16);
+        u = _mm256_or_si256(_mm256_slli_epi32(u, 2), _mm256_srli_epi32(u, 30));
+        return _mm256_xor_si256(_mm256_xor_si256(x0, a), _mm256_xor_si256(r24, u));
+    }
+
+    SM4_TARGET_AESNI_AVX2 static void transpose(__m256i& a, __m256i& b, __m256i& c, __m256i& d) {
+        __m256i t0 = _mm256_unpacklo_epi32(a, b), t1 = _mm256_unpacklo_epi32(c, d);
+        __m256i t2 = _mm256_unpackhi_epi32(a, b), t3 = _mm256_unpackhi_epi32(c, d);
+        a = _mm256_unpacklo_epi64(t0, t1); b = _mm256_unpackhi_epi64(t0, t1);
+        c = _mm256_unpacklo_epi64(t2, t3); d = _mm256_unpackhi_epi64(t2, t3);
+    }
+
+    SM4_TARGET_AESNI_AVX2 static __m256i load2(const uint8_t* lo, const uint8_t* hi) {
+        return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)lo)),
+            _mm_loadu_si128((const __m128i*)hi), 1);
+    }
+
+    SM4_TARGET_AESNI_AVX2 static void store2(uint8_t* lo, uint8_t* hi, __m256i x) {
+        _mm_storeu_si128((__m128i*)lo, _mm256_castsi256_si128(x));
+        _mm_storeu_si128((__m128i*)hi, _mm256_extracti128_si256(x, 1));
+    }
+
+    template <bool Dec, class Keys>
+    SM4_TARGET_AESNI_AVX2 static void crypt8(const Keys& keys, const uint8_t* in, uint8_t* out) {
+        const __m256i bswap = _mm256_broadcastsi128_si256(
+            _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12));
+        __m256i s0 = _mm256_shuffle_epi8(load2(in, in + 64), bswap);
+        __m256i s1 = _mm256_shuffle_epi8(load2(in + 16, in + 80), bswap);
+        __m256i s2 = _mm256_shuffle_epi8(load2(in + 32, in + 96), bswap);
+        __m256i s3 = _mm256_shuffle_epi8(load2(in + 48, in + 112), bswap);
+        transpose(s0, s1, s2, s3);
+
+        for (int i = 0; i < ROUNDS; i += 4) {
+            const __m256i k0 = keys.x8(Dec ? ROUNDS - 1 - i : i);
+            const __m256i k1 = keys.x8(Dec ? ROUNDS - 2 - i : i + 1);
+            const __m256i k2 = keys.x8(Dec ? ROUNDS - 3 - i : i + 2);
+            const __m256i k3 = keys.x8(Dec ? ROUNDS - 4 - i : i + 3);
+            s0 = round_f(s0, _mm256_xor_si256(_mm256_xor_si256(s1, s2), _mm256_xor_si256(s3, k0)));
+            s1 = round_f(s1, _mm256_xor_si256(_mm256_xor_si256(s2, s3), _mm256_xor_si256(s0, k1)));
+            s2 = round_f(s2, _mm256_xor_si256(_mm256_xor_si256(s3, s0), _mm256_xor_si256(s1, k2)));
+            s3 = round_f(s3, _mm256_xor_si256(_mm256_xor_si256(s0, s1), _mm256_xor_si256(s2, k3)));
+        }
+
+        transpose(s3, s2, s1, s0);
+        store2(out, out + 64, _mm256_shuffle_epi8(s3, bswap));
+        store2(out + 16, out + 80, _mm256_shuffle_epi8(s2, bswap));
+        store2(out + 32, out + 96, _mm256_shuffle_epi8(s1, bswap));
+        store2(out + 48, out + 112, _mm256_shuffle_epi8(s0, bswap));
+    }
+
+    // 8x8 transpose of 32-bit words: r[i][j] <-> r[j][i]
+    SM4_TARGET_AESNI_AVX2 static void transpose8(__m256i r[8]) {
+        __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]), t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+        __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]), t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+        __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]), t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+        __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]), t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+        __m256i u0 = _mm256_unpacklo_epi64(t0, t2), u1 = _mm256_unpackhi_epi64(t0, t2);
+        __m256i u2 = _mm256_unpacklo_epi64(t1, t3), u3 = _mm256_unpackhi_epi64(t1, t3);
+        __m256i u4 = _mm256_unpacklo_epi64(t4, t6), u5 = _mm256_unpackhi_epi64(t4, t6);
+        __m256i u6 = _mm256_unpacklo_epi64(t5, t7), u7 = _mm256_unpackhi_epi64(t5, t7);
+        r[0] = _mm256_permute2x128_si256(u0, u4, 0x20); r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+        r[1] = _mm256_permute2x128_si256(u1, u5, 0x20); r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+        r[2] = _mm256_permute2x128_si256(u2, u6, 0x20); r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+        r[3] = _mm256_permute2x128_si256(u3, u7, 0x20); r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
     }
 
-    __m128i sm4_round(__m128i x0, __m128i x1, __m128i x2, __m128i x3, __m128i rk) {
-        __m128i T_val = _mm_xor_si128(_mm_xor_si128(x1, x2), _mm_xor_si128(x3, rk));
-        T_val = sm4_sbox_aesni(T_val);
-        return _mm_xor_si128(x0, T_val);
+    // One block without the 4-block transpose and zero padding: every lane of
+    // s_i holds word i of the same block, and lane 0 is stored.
+    template <bool Dec>
+    SM4_TARGET_AESNI void crypt1(const uint8_t in[16], uint8_t out[16]) const {
+        const __m128i bswap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+        __m128i x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)in), bswap);
+        __m128i s0 = _mm_shuffle_epi32(x, 0x00), s1 = _mm_shuffle_epi32(x, 0x55);
+        __m128i s2 = _mm_shuffle_epi32(x, 0xAA), s3 = _mm_shuffle_epi32(x, 0xFF);
+
+        for (int i = 0; i < ROUNDS; i += 4) {
+            const __m128i k0 = _mm_set1_epi32((int)rk[Dec ? ROUNDS - 1 - i : i]);
+            const __m128i k1 = _mm_set1_epi32((int)rk[Dec ? ROUNDS - 2 - i : i + 1]);
+            const __m128i k2 = _mm_set1_epi32((int)rk[Dec ? ROUNDS - 3 - i : i + 2]);
+            const __m128i k3 = _mm_set1_epi32((int)rk[Dec ? ROUNDS - 4 - i : i + 3]);
+            s0 = round_f(s0, _mm_xor_si128(_mm_xor_si128(s1, s2), _mm_xor_si128(s3, k0)));
+            s1 = round_f(s1, _mm_xor_si128(_mm_xor_si128(s2, s3), _mm_xor_si128(s0, k1)));
+            s2 = round_f(s2, _mm_xor_si128(_mm_xor_si128(s3, s0), _mm_xor_si128(s1, k2)));
+            s3 = round_f(s3, _mm_xor_si128(_mm_xor_si128(s0, s1), _mm_xor_si128(s2, k3)));
+        }
+
+        x = _mm_unpacklo_epi64(_mm_unpacklo_epi32(s3, s2), _mm_unpacklo_epi32(s1, s0));
+        _mm_storeu_si128((__m128i*)out, _mm_shuffle_epi8(x, bswap));
+    }
+
+    template <bool Dec, class Keys>
+    SM4_TARGET_AESNI void crypt_blocks(Keys keys, const uint8_t* in, uint8_t* out, size_t nblocks) {
+        if (use_avx2) {
+            for (; nblocks >= 8; nblocks -= 8, in += 128, out += 128, keys = keys.at(8))
+                crypt8<Dec>(keys, in, out);
+        }
+        for (; nblocks >= 4; nblocks -= 4, in += 64, out += 64, keys = keys.at(4))
+            crypt4<Dec>(keys, in, out);
+        if (nblocks > 0) {
+            uint8_t tmp[64] = { 0 };
+            uint32_t tail_off[4];
+            memcpy(tmp, in, nblocks * 16);
+            crypt4<Dec>(keys.padded(nblocks, tail_off), tmp, tmp);
+            memcpy(out, tmp, nblocks * 16);
+        }
     }
 
 public:
-    void set_key(const uint8_t key[16]) {
-        __m128i K[4];
-        K[0] = _mm_loadu_si128((const __m128i*)key);
+    // avx2 selects the 8-block ymm kernel; the caller must have checked
+    // that the host supports it.
+    explicit SM4_AESNI(bool avx2 = sm4_cpu().avx2) : use_avx2(avx2) {
+    }
 
-        for (int i = 0; i < ROUNDS; i++) {
-           
-            rk[i] = _mm_aeskeygenassist_si128(K[0], i);
+    SM4_TARGET_AESNI void set_key(const uint8_t key[16]) {
+        uint32_t K[4];
+        for (int i = 0; i < 4; ++i) {
+            K[i] = ((key[i * 4] << 24) | (key[i * 4 + 1] << 16) |
+                (key[i * 4 + 2] << 8) | key[i * 4 + 3]) ^ SM4_FK[i];
+        }
+
+        for (int i = 0; i < ROUNDS; ++i) {
+            uint32_t T_val = K[(i + 1) % 4] ^ K[(i + 2) % 4] ^ K[(i + 3) % 4] ^ SM4_CK[i];
+            // a broadcast word looks the same in every column, so ShiftRows is a no-op here
+            uint32_t result = (uint32_t)_mm_cvtsi128_si32(sbox_shifted(_mm_set1_epi32((int)T_val)));
+            rk[i] = K[i % 4] ^ result ^ ((result << 13) | (result >> 19)) ^ ((result << 23) | (result >> 9));
+            K[i % 4] = rk[i];
         }
     }
 
-    void encrypt(const uint8_t in[16], uint8_t out[16]) {
-        __m128i state = _mm_loadu_si128((const __m128i*)in);
+    // Key schedules of 8 keys (128 contiguous bytes) at once, lane l of every
+    // ymm holding key l. enc gets 8 schedules of ROUNDS words, dec (if not
+    // null) the same schedules reversed. Requires AVX2.
+    SM4_TARGET_AESNI_AVX2 static void expand_keys8(const uint8_t keys[128], uint32_t* enc, uint32_t* dec) {
+        const __m256i bswap = _mm256_broadcastsi128_si256(
+            _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12));
+        // lanes hold different keys here, so the ShiftRows inside
+        // sbox_shifted has to be undone
+        const __m256i inv_shift = _mm256_broadcastsi128_si256(
+            _mm_setr_epi8(0, 13, 10, 7, 4, 1, 14, 11, 8, 5, 2, 15, 12, 9, 6, 3));
+        const __m256i reverse = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+        const __m256i idx = _mm256_setr_epi32(0, 4, 8, 12, 16, 20, 24, 28);
 
-        for (int i = 0; i < ROUNDS; i++) {
-          
+        __m256i K[4], rk8[8];
+        for (int w = 0; w < 4; ++w) {
+            K[w] = _mm256_i32gather_epi32((const int*)keys, _mm256_add_epi32(idx, _mm256_set1_epi32(w)), 4);
+            K[w] = _mm256_xor_si256(_mm256_shuffle_epi8(K[w], bswap), _mm256_set1_epi32((int)SM4_FK[w]));
         }
 
-        _mm_storeu_si128((__m128i*)out, state);
+        for (int i = 0; i < ROUNDS; ++i) {
+            __m256i t = _mm256_xor_si256(_mm256_xor_si256(K[(i + 1) % 4], K[(i + 2) % 4]),
+                _mm256_xor_si256(K[(i + 3) % 4], _mm256_set1_epi32((int)SM4_CK[i])));
+            t = _mm256_shuffle_epi8(sbox_shifted(t), inv_shift);
+            t = _mm256_xor_si256(t, _mm256_xor_si256(
+                _mm256_or_si256(_mm256_slli_epi32(t, 13), _mm256_srli_epi32(t, 19)),
+                _mm256_or_si256(_mm256_slli_epi32(t, 23), _mm256_srli_epi32(t, 9))));
+            K[i % 4] = _mm256_xor_si256(K[i % 4], t);
+            rk8[i % 8] = K[i % 4];
+
+            // every 8 rounds, turn round-major vectors into key-major rows
+            if (i % 8 == 7) {
+                transpose8(rk8);
+                for (int l = 0; l < 8; ++l) {
+                    _mm256_storeu_si256((__m256i*)(enc + l * ROUNDS + i - 7), rk8[l]);
+                    if (dec) {
+                        _mm256_storeu_si256((__m256i*)(dec + l * ROUNDS + ROUNDS - 1 - i),
+                            _mm256_permutevar8x32_epi32(rk8[l], reverse));
+                    }
+                }
+            }
+        }
+    }
+
+    void encrypt(const uint8_t in[16], uint8_t out[16]) {
+        crypt1<false>(in, out);
     }
 
     void decrypt(const uint8_t in[16], uint8_t out[16]) {
-        __m128i state = _mm_loadu_si128((const __m128i*)in);
+        crypt1<true>(in, out);
+    }
 
-        for (int i = ROUNDS - 1; i >= 0; i--) {
-       
-        }
+    void encrypt_blocks(const uint8_t* in, uint8_t* out, size_t nblocks) {
+        if (nblocks == 1) crypt1<false>(in, out);
+        else crypt_blocks<false>(OneKey{ rk }, in, out, nblocks);
+    }
+
+    void decrypt_blocks(const uint8_t* in, uint8_t* out, size_t nblocks) {
+        if (nblocks == 1) crypt1<true>(in, out);
+        else crypt_blocks<true>(OneKey{ rk }, in, out, nblocks);
+    }
+
+    // Block b uses the schedule at slab + off[b] (see SM4_TTable).
+    void encrypt_blocks_multikey(const uint32_t* slab, const uint32_t* off,
+        const uint8_t* in, uint8_t* out, size_t nblocks) {
+        crypt_blocks<false>(LaneKeys{ slab, off }, in, out, nblocks);
+    }
 
-        _mm_storeu_si128((__m128i*)out, state);
+    void decrypt_blocks_multikey(const uint32_t* slab, const uint32_t* off,
+        const uint8_t* in, uint8_t* out, size_t nblocks) {
+        crypt_blocks<true>(LaneKeys{ slab, off }, in, out, nblocks);
     }
 };
 #endif
 
 
-#if defined(__GFNI__) && defined(__AVX512F__)
+#ifdef SM4_HAVE_X86
+// SM4 on GFNI + AVX-512. The S-box is S(x) = A2 * inv(A1 * x + c1) + c2
+// with inv taken in the AES field: A1/c1 hold the SM4 input affine map
+// composed with the field isomorphism (GF2P8AFFINEQB), A2/c2 the output map
+// composed with its inverse (GF2P8AFFINEINVQB). 16 blocks are transposed
+// into four word-sliced zmm registers, so one pass of 32 rounds encrypts
+// 256 bytes.
 class SM4_GFNI_AVX512 {
 private:
-    __m512i rk[32];
+    static const uint64_t PRE_AFFINE = 0x4C287DB91A22505D;
+    static const uint8_t PRE_CONST = 0x3E;
+    static const uint64_t POST_AFFINE = 0xF3AB34A974A6B589;
+    static const uint8_t POST_CONST = 0xD3;
+
+    uint32_t rk[ROUNDS];
+
+    // Round-key vectors for crypt16. Lane 4q+j of the transposed state holds
+    // block 4j+q, so per-block offsets are permuted into lane order once and
+    // every round is a single gather from the slab.
+    struct OneKey {
+        const uint32_t* rk;
+        SM4_TARGET_GFNI_AVX512 __m512i lane_index() const { return _mm512_setzero_si512(); }
+        SM4_TARGET_GFNI_AVX512 __m512i x16(__m512i, int r) const { return _mm512_set1_epi32((int)rk[r]); }
+        OneKey at(size_t) const { return *this; }
+        OneKey padded(size_t, uint32_t*) const { return *this; }
+    };
+
+    struct LaneKeys {
+        const uint32_t* slab;
+        const uint32_t* off;
+        SM4_TARGET_GFNI_AVX512 __m512i lane_index() const {
+            const __m512i perm = _mm512_setr_epi32(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+            return _mm512_permutexvar_epi32(perm, _mm512_loadu_si512((const __m512i*)off));
+        }
+        SM4_TARGET_GFNI_AVX512 __m512i x16(__m512i idx, int r) const {
+            return _mm512_i32gather_epi32(_mm512_add_epi32(idx, _mm512_set1_epi32(r)), (const int*)slab, 4);
+        }
+        LaneKeys at(size_t b) const { return LaneKeys{ slab, off + b }; }
+        // offsets for a zero-padded tail of n blocks; unused lanes reuse block 0's key
+        LaneKeys padded(size_t n, uint32_t* buf) const {
+            for (size_t b = 0; b < 16; ++b) buf[b] = off[b < n ? b : 0];
+            return LaneKeys{ slab, buf };
+        }
+    };
 
-    __m512i sm4_sbox_gfni(__m512i x) {
-        const __m512i affine_matrix = _mm512_set1_epi64(0xC6A1B5D7E390F284); 
-        const __m512i constant_term = _mm512_set1_epi8(0x63);
+    SM4_TARGET_GFNI_AVX512 static __m512i sm4_sbox_gfni(__m512i x) {
+        x = _mm512_gf2p8affine_epi64_epi8(x, _mm512_set1_epi64(PRE_AFFINE), PRE_CONST);
+        return _mm512_gf2p8affineinv_epi64_epi8(x, _mm512_set1_epi64(POST_AFFINE), POST_CONST);
+    }
 
-        x = _mm512_gf2p8affine_epi64_epi8(x, affine_matrix, 0);
-        x = _mm512_xor_si512(x, constant_term);
-        return x;
+    SM4_TARGET_GFNI_AVX512 static __m512i sm4_linear(__m512i x) {
+        __m512i t = _mm512_ternarylogic_epi32(x, _mm512_rol_epi32(x, 2), _mm512_rol_epi32(x, 10), 0x96);
+        return _mm512_ternarylogic_epi32(t, _mm512_rol_epi32(x, 18), _mm512_rol_epi32(x, 24), 0x96);
     }
 
-    
-    __m512i sm4_linear(__m512i x) {
-        __m512i t0 = _mm512_rol_epi32(x, 2);
-        __m512i t1 = _mm512_rol_epi32(x, 10);
-        __m512i t2 = _mm512_rol_epi32(x, 18);
-        __m512i t3 = _mm512_rol_epi32(x, 24);
-        return _mm512_xor_epi32(_mm512_xor_epi32(x, t0),
-            _mm512_xor_epi32(t1, _mm512_xor_epi32(t2, t3)));
-    }
-
-    __m512i sm4_round(__m512i x0, __m512i x1, __m512i x2, __m512i x3, __m512i rk) {
-        __m512i T_val = _mm512_xor_epi32(_mm512_xor_epi32(x1, x2),
-            _mm512_xor_epi32(x3, rk));
+    SM4_TARGET_GFNI_AVX512 static __m512i sm4_round(__m512i x0, __m512i x1, __m512i x2, __m512i x3, __m512i rk) {
+        __m512i T_val = _mm512_xor_si512(_mm512_ternarylogic_epi32(x1, x2, x3, 0x96), rk);
         T_val = sm4_sbox_gfni(T_val);
         T_val = sm4_linear(T_val);
-        return _mm512_xor_epi32(x0, T_val);
+        return _mm512_xor_si512(x0, T_val);
+    }
+
+    // 4x4 word transpose inside every 128-bit lane: afterwards lane j of
+    // register i holds word i of blocks j, 4+j, 8+j and 12+j.
+    SM4_TARGET_GFNI_AVX512 static void transpose(__m512i& a, __m512i& b, __m512i& c, __m512i& d) {
+        __m512i t0 = _mm512_unpacklo_epi32(a, b), t1 = _mm512_unpacklo_epi32(c, d);
+        __m512i t2 = _mm512_unpackhi_epi32(a, b), t3 = _mm512_unpackhi_epi32(c, d);
+        a = _mm512_unpacklo_epi64(t0, t1); b = _mm512_unpackhi_epi64(t0, t1);
+        c = _mm512_unpacklo_epi64(t2, t3); d = _mm512_unpackhi_epi64(t2, t3);
+    }
+
+    template <bool Dec, class Keys>
+    SM4_TARGET_GFNI_AVX512 void crypt16(const Keys& keys, const uint8_t in[256], uint8_t out[256]) {
+        const __m512i bswap = _mm512_broadcast_i32x4(
+            _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12));
+        __m512i s0 = _mm512_shuffle_epi8(_mm512_loadu_si512((const __m512i*)(in)), bswap);
+        __m512i s1 = _mm512_shuffle_epi8(_mm512_loadu_si512((const __m512i*)(in + 64)), bswap);
+        __m512i s2 = _mm512_shuffle_epi8(_mm512_loadu_si512((const __m512i*)(in + 128)), bswap);
+        __m512i s3 = _mm512_shuffle_epi8(_mm512_loadu_si512((const __m512i*)(in + 192)), bswap);
+        transpose(s0, s1, s2, s3);
+
+        const __m512i idx = keys.lane_index();
+        for (int i = 0; i < ROUNDS; i += 4) {
+            s0 = sm4_round(s0, s1, s2, s3, keys.x16(idx, Dec ? ROUNDS - 1 - i : i));
+            s1 = sm4_round(s1, s2, s3, s0, keys.x16(idx, Dec ? ROUNDS - 2 - i : i + 1));
+            s2 = sm4_round(s2, s3, s0, s1, keys.x16(idx, Dec ? ROUNDS - 3 - i : i + 2));
+            s3 = sm4_round(s3, s0, s1, s2, keys.x16(idx, Dec ? ROUNDS - 4 - i : i + 3));
+        }
+
+        transpose(s3, s2, s1, s0);
+        _mm512_storeu_si512((__m512i*)(out), _mm512_shuffle_epi8(s3, bswap));
+        _mm512_storeu_si512((__m512i*)(out + 64), _mm512_shuffle_epi8(s2, bswap));
+        _mm512_storeu_si512((__m512i*)(out + 128), _mm512_shuffle_epi8(s1, bswap));
+        _mm512_storeu_si512((__m512i*)(out + 192), _mm512_shuffle_epi8(s0, bswap));
+    }
+
+    // One block without the 16-block transpose and zero padding: every lane
+    // of s_i holds word i of the same block, and lane 0 is stored.
+    template <bool Dec>
+    SM4_TARGET_GFNI_AVX512 void crypt1(const uint8_t in[16], uint8_t out[16]) const {
+        const __m128i bswap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+        __m128i x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)in), bswap);
+        __m512i s0 = _mm512_broadcastd_epi32(x), s1 = _mm512_broadcastd_epi32(_mm_shuffle_epi32(x, 0x55));
+        __m512i s2 = _mm512_broadcastd_epi32(_mm_shuffle_epi32(x, 0xAA));
+        __m512i s3 = _mm512_broadcastd_epi32(_mm_shuffle_epi32(x, 0xFF));
+
+        for (int i = 0; i < ROUNDS; i += 4) {
+            s0 = sm4_round(s0, s1, s2, s3, _mm512_set1_epi32((int)rk[Dec ? ROUNDS - 1 - i : i]));
+            s1 = sm4_round(s1, s2, s3, s0, _mm512_set1_epi32((int)rk[Dec ? ROUNDS - 2 - i : i + 1]));
+            s2 = sm4_round(s2, s3, s0, s1, _mm512_set1_epi32((int)rk[Dec ? ROUNDS - 3 - i : i + 2]));
+            s3 = sm4_round(s3, s0, s1, s2, _mm512_set1_epi32((int)rk[Dec ? ROUNDS - 4 - i : i + 3]));
+        }
+
+        x = _mm_unpacklo_epi64(
+            _mm_unpacklo_epi32(_mm512_castsi512_si128(s3), _mm512_castsi512_si128(s2)),
+            _mm_unpacklo_epi32(_mm512_castsi512_si128(s1), _mm512_castsi512_si128(s0)));
+        _mm_storeu_si128((__m128i*)out, _mm_shuffle_epi8(x, bswap));
+    }
+
+    template <bool Dec, class Keys>
+    SM4_TARGET_GFNI_AVX512 void crypt_blocks(Keys keys, const uint8_t* in, uint8_t* out, size_t nblocks) {
+        for (; nblocks >= 16; nblocks -= 16, in += 256, out += 256, keys = keys.at(16))
+            crypt16<Dec>(keys, in, out);
+        if (nblocks > 0) {
+            alignas(64) uint8_t tmp[256] = { 0 };
+            uint32_t tail_off[16];
+            memcpy(tmp, in, nblocks * 16);
+            crypt16<Dec>(keys.padded(nblocks, tail_off), tmp, tmp);
+            memcpy(out, tmp, nblocks * 16);
+        }
     }
 
 public:
-    void set_key(const uint8_t key[16]) {
-       
-        __m128i key128 = _mm_loadu_si128((const __m128i*)key);
-        __m512i key512 = _mm512_broadcast_i32x4(key128);
+    SM4_TARGET_GFNI_AVX512 void set_key(const uint8_t key[16]) {
+        uint32_t K[4];
+        for (int i = 0; i < 4; ++i) {
+            K[i] = ((key[i * 4] << 24) | (key[i * 4 + 1] << 16) |
+                (key[i * 4 + 2] << 8) | key[i * 4 + 3]) ^ SM4_FK[i];
+        }
 
-        for (int i = 0; i < ROUNDS; i++) {
-            
-            rk[i] = key512; 
+        for (int i = 0; i < ROUNDS; ++i) {
+            uint32_t T_val = K[(i + 1) % 4] ^ K[(i + 2) % 4] ^ K[(i + 3) % 4] ^ SM4_CK[i];
+            __m128i t = _mm_gf2p8affine_epi64_epi8(_mm_cvtsi32_si128((int)T_val), _mm_set1_epi64x(PRE_AFFINE), PRE_CONST);
+            t = _mm_gf2p8affineinv_epi64_epi8(t, _mm_set1_epi64x(POST_AFFINE), POST_CONST);
+            uint32_t result = (uint32_t)_mm_cvtsi128_si32(t);
+            rk[i] = K[i % 4] ^ result ^ ((result << 13) | (result >> 19)) ^ ((result << 23) | (result >> 9));
+            K[i % 4] = rk[i];
         }
     }
 
-   
-    void encrypt_4blocks(const uint8_t in[64], uint8_t out[64]) {
-        __m512i block0 = _mm512_loadu_si512((const __m512i*)(in));
-        __m512i block1 = _mm512_loadu_si512((const __m512i*)(in + 16));
-        __m512i block2 = _mm512_loadu_si512((const __m512i*)(in + 32));
-        __m512i block3 = _mm512_loadu_si512((const __m512i*)(in + 48));
+    // Key schedules of 16 keys (256 contiguous bytes) at once, lane l of
+    // every zmm holding key l; each round key is scattered straight into its
+    // row of enc and, if not null, of the reversed schedules in dec.
+    SM4_TARGET_GFNI_AVX512 static void expand_keys16(const uint8_t keys[256], uint32_t* enc, uint32_t* dec) {
+        const __m512i bswap = _mm512_broadcast_i32x4(
+            _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12));
+        const __m512i idx = _mm512_setr_epi32(0, 4, 8, 12, 16, 20, 24, 28, 32, 36, 40, 44, 48, 52, 56, 60);
+        const __m512i row = _mm512_slli_epi32(idx, 3); // l * ROUNDS
+
+        __m512i K[4];
+        for (int w = 0; w < 4; ++w) {
+            K[w] = _mm512_i32gather_epi32(_mm512_add_epi32(idx, _mm512_set1_epi32(w)), (const int*)keys, 4);
+            K[w] = _mm512_xor_si512(_mm512_shuffle_epi8(K[w], bswap), _mm512_set1_epi32((int)SM4_FK[w]));
+        }
+
+        for (int i = 0; i < ROUNDS; ++i) {
+            __m512i t = _mm512_xor_si512(_mm512_ternarylogic_epi32(K[(i + 1) % 4], K[(i + 2) % 4], K[(i + 3) % 4], 0x96),
+                _mm512_set1_epi32((int)SM4_CK[i]));
+            t = sm4_sbox_gfni(t);
+            t = _mm512_ternarylogic_epi32(t, _mm512_rol_epi32(t, 13), _mm512_rol_epi32(t, 23), 0x96);
+            K[i % 4] = _mm512_xor_si512(K[i % 4], t);
+            _mm512_i32scatter_epi32(enc, _mm512_add_epi32(row, _mm512_set1_epi32(i)), K[i % 4], 4);
+            if (dec) {
+                _mm512_i32scatter_epi32(dec, _mm512_add_epi32(row, _mm512_set1_epi32(ROUNDS - 1 - i)), K[i % 4], 4);
+            }
+        }
+    }
+
+    void encrypt(const uint8_t in[16], uint8_t out[16]) {
+        crypt1<false>(in, out);
+    }
+
+    void decrypt(const uint8_t in[16], uint8_t out[16]) {
+        crypt1<true>(in, out);
+    }
+
+    void encrypt_blocks(const uint8_t* in, uint8_t* out, size_t nblocks) {
+        if (nblocks == 1) crypt1<false>(in, out);
+        else crypt_blocks<false>(OneKey{ rk }, in, out, nblocks);
+    }
+
+    void decrypt_blocks(const uint8_t* in, uint8_t* out, size_t nblocks) {
+        if (nblocks == 1) crypt1<true>(in, out);
+        else crypt_blocks<true>(OneKey{ rk }, in, out, nblocks);
+    }
+
+    void encrypt_blocks_multikey(const uint32_t* slab, const uint32_t* off,
+        const uint8_t* in, uint8_t* out, size_t nblocks) {
+        crypt_blocks<false>(LaneKeys{ slab, off }, in, out, nblocks);
+    }
+
+    void decrypt_blocks_multikey(const uint32_t* slab, const uint32_t* off,
+        const uint8_t* in, uint8_t* out, size_t nblocks) {
+        crypt_blocks<true>(LaneKeys{ slab, off }, in, out, nblocks);
+    }
+};
+#endif
+
+
+#ifdef SM4_HAVE_X86
+// Bitsliced SM4. Bit j of state word w for 128 or 256 blocks is one vector
+// (bit b belongs to block b), so the S-box is a boolean circuit over whole
+// registers and the rotations of L are just re-indexing. Nothing indexes
+// memory or branches on data or key bits, so the timing is constant; the key
+// schedule runs its S-boxes through the same circuit. Per-block schedules
+// passed to the multikey calls are the caller's: expand them with
+// SM4_Bitslice::expand_key to keep that path table-free too.
+// Blocks enter and leave the sliced form through a 16x16 byte transpose
+// and PMOVMSKB. The kernels are written with GCC vector types so the same
+// code compiles to SSE2 (128 blocks) and, inlined into an AVX2 function,
+// to ymm (256 blocks).
+typedef uint64_t sm4_bs128 __attribute__((vector_size(16)));
+typedef uint64_t sm4_bs256 __attribute__((vector_size(32)));
 
-        
+#define SM4_BS_INLINE inline __attribute__((always_inline))
 
-        _mm512_storeu_si512((__m512i*)out, block0);
-        _mm512_storeu_si512((__m512i*)(out + 16), block1);
-        _mm512_storeu_si512((__m512i*)(out + 32), block2);
-        _mm512_storeu_si512((__m512i*)(out + 48), block3);
+class SM4_Bitslice {
+private:
+    uint32_t rk[ROUNDS];
+    bool use_avx2;
+
+    // SM4 S-box on 8 bit planes (x[i] = bit i of the byte), computed as
+    // A * inv(A * x + C) + C with the inversion done in GF((2^4)^2):
+    // GF(16) = GF(2)[z]/(z^4 + z + 1), y^2 + y + 8 over it, and the field
+    // isomorphism folded into the outer affine maps. 174 gates plus 5 NOTs,
+    // generated and checked against the table for all 256 inputs.
+    template <class V>
+    static SM4_BS_INLINE void sbox(V* x) {
+        const V x0 = x[0], x1 = x[1], x2 = x[2], x3 = x[3];
+        const V x4 = x[4], x5 = x[5], x6 = x[6], x7 = x[7];
+        const V t0 = x0 ^ x1;
+        const V t1 = x2 ^ x5;
+        const V t2 = x3 ^ x4;
+        const V t3 = x6 ^ x7;
+        const V t4 = x6 ^ t1;
+        const V t5 = t2 ^ t3;
+        const V t6 = x0 ^ t4;
+        const V t7 = x1 ^ x7;
+        const V t8 = t7 ^ t1;
+        const V t9 = t8 ^ t2;
+        const V t10 = x5 ^ t0;
+        const V t11 = t10 ^ t3;
+        const V t12 = x4 ^ x7;
+        const V t13 = t12 ^ t0;
+        const V t14 = x2 ^ t3;
+        const V t15 = t0 ^ t2;
+        const V t16 = t15 ^ t4;
+        const V t17 = t9 ^ t14;
+        const V t18 = t5 ^ t17;
+        const V t19 = x6 ^ t16;
+        const V t20 = t19 ^ t17;
+        const V t21 = t6 ^ t11;
+        const V t22 = t21 ^ x6;
+        const V t23 = t11 ^ t13;
+        const V t24 = t23 ^ t14;
+        const V t25 = t24 ^ t16;
+        const V t26 = t13 & t5;
+        const V t27 = t13 & t6;
+        const V t28 = ~t9 & t13;
+        const V t29 = ~t11 & t13;
+        const V t30 = ~x6 & t5;
+        const V t31 = t27 ^ t30;
+        const V t32 = ~x6 & t6;
+        const V t33 = t28 ^ t32;
+        const V t34 = x6 | t9;
+        const V t35 = t29 ^ t34;
+        const V t36 = x6 | t11;
+        const V t37 = t14 & t5;
+        const V t38 = t33 ^ t37;
+        const V t39 = t14 & t6;
+        const V t40 = t35 ^ t39;
+        const V t41 = ~t9 & t14;
+        const V t42 = t36 ^ t41;
+        const V t43 = ~t11 & t14;
+        const V t44 = ~t16 & t5;
+        const V t45 = t40 ^ t44;
+        const V t46 = ~t16 & t6;
+        const V t47 = t42 ^ t46;
+        const V t48 = t16 | t9;
+        const V t49 = t43 ^ t48;
+        const V t50 = t16 | t11;
+        const V t51 = t26 ^ t47;
+        const V t52 = t31 ^ t47;
+        const V t53 = t52 ^ t49;
+        const V t54 = t38 ^ t49;
+        const V t55 = t54 ^ t50;
+        const V t56 = t45 ^ t50;
+        const V t57 = t18 ^ t51;
+        const V t58 = t20 ^ t53;
+        const V t59 = t22 ^ t55;
+        const V t60 = t25 ^ t56;
+        const V t61 = t57 ^ t58;
+        const V t62 = t61 ^ t59;
+        const V t63 = t57 & t59;
+        const V t64 = t62 ^ t63;
+        const V t65 = ~t58 & t59;
+        const V t66 = t64 ^ t65;
+        const V t67 = ~t58 & t57;
+        const V t68 = t67 & t59;
+        const V t69 = t66 ^ t68;
+        const V t70 = t69 ^ t60;
+        const V t71 = t65 & t60;
+        const V t72 = t70 ^ t71;
+        const V t73 = t67 ^ t63;
+        const V t74 = t73 ^ t65;
+        const V t75 = t74 ^ t60;
+        const V t76 = ~t58 & t60;
+        const V t77 = t75 ^ t76;
+        const V t78 = t67 & t60;
+        const V t79 = t77 ^ t78;
+        const V t80 = t67 ^ t59;
+        const V t81 = t80 ^ t63;
+        const V t82 = t81 ^ t60;
+        const V t83 = t57 & t60;
+        const V t84 = t82 ^ t83;
+        const V t85 = t63 & t60;
+        const V t86 = t84 ^ t85;
+        const V t87 = t58 ^ t59;
+        const V t88 = t87 ^ t60;
+        const V t89 = t88 ^ t83;
+        const V t90 = t89 ^ t76;
+        const V t91 = t59 & t60;
+        const V t92 = t90 ^ t91;
+        const V t93 = t92 ^ t71;
+        const V t94 = ~t72 & t13;
+        const V t95 = t13 & t79;
+        const V t96 = t13 & t86;
+        const V t97 = ~t93 & t13;
+        const V t98 = x6 | t72;
+        const V t99 = t95 ^ t98;
+        const V t100 = ~x6 & t79;
+        const V t101 = t96 ^ t100;
+        const V t102 = ~x6 & t86;
+        const V t103 = t97 ^ t102;
+        const V t104 = x6 | t93;
+        const V t105 = ~t72 & t14;
+        const V t106 = t101 ^ t105;
+        const V t107 = t14 & t79;
+        const V t108 = t103 ^ t107;
+        const V t109 = t14 & t86;
+        const V t110 = t104 ^ t109;
+        const V t111 = ~t93 & t14;
+        const V t112 = t16 | t72;
+        const V t113 = t108 ^ t112;
+        const V t114 = ~t16 & t79;
+        const V t115 = t110 ^ t114;
+        const V t116 = ~t16 & t86;
+        const V t117 = t111 ^ t116;
+        const V t118 = t16 | t93;
+        const V t119 = t94 ^ t115;
+        const V t120 = t99 ^ t115;
+        const V t121 = t120 ^ t117;
+        const V t122 = t106 ^ t117;
+        const V t123 = t122 ^ t118;
+        const V t124 = t113 ^ t118;
+        const V t125 = t5 ^ t13;
+        const V t126 = t6 ^ x6;
+        const V t127 = t9 ^ t14;
+        const V t128 = t11 ^ t16;
+        const V t129 = ~t72 & t125;
+        const V t130 = t125 & t79;
+        const V t131 = t125 & t86;
+        const V t132 = ~t93 & t125;
+        const V t133 = t126 | t72;
+        const V t134 = t130 ^ t133;
+        const V t135 = ~t126 & t79;
+        const V t136 = t131 ^ t135;
+        const V t137 = ~t126 & t86;
+        const V t138 = t132 ^ t137;
+        const V t139 = t126 | t93;
+        const V t140 = t127 | t72;
+        const V t141 = t136 ^ t140;
+        const V t142 = ~t127 & t79;
+        const V t143 = t138 ^ t142;
+        const V t144 = ~t127 & t86;
+        const V t145 = t139 ^ t144;
+        const V t146 = t127 | t93;
+        const V t147 = ~t72 & t128;
+        const V t148 = t143 ^ t147;
+        const V t149 = t128 & t79;
+        const V t150 = t145 ^ t149;
+        const V t151 = t128 & t86;
+        const V t152 = t146 ^ t151;
+        const V t153 = ~t93 & t128;
+        const V t154 = t129 ^ t150;
+        const V t155 = t134 ^ t150;
+        const V t156 = t155 ^ t152;
+        const V t157 = t141 ^ t152;
+        const V t158 = t157 ^ t153;
+        const V t159 = t148 ^ t153;
+        const V t160 = t154 ^ t119;
+        const V t161 = t158 ^ t123;
+        const V t162 = t156 ^ t159;
+        const V t163 = t156 ^ t160;
+        const V t164 = t119 ^ t162;
+        const V t165 = t121 ^ t124;
+        const V t166 = t124 ^ t163;
+        const V t167 = t154 ^ t161;
+        const V t168 = t161 ^ t165;
+        const V t169 = t158 ^ t124;
+        const V t170 = t169 ^ t160;
+        const V t171 = t164 ^ t165;
+        const V t172 = t161 ^ t163;
+        const V t173 = t159 ^ t160;
+        x[0] = t166;
+        x[1] = ~t167;
+        x[2] = ~t168;
+        x[3] = t170;
+        x[4] = ~t164;
+        x[5] = t171;
+        x[6] = ~t172;
+        x[7] = ~t173;
+    }
+
+    // Round-key planes for 4 rounds starting at round i (reversed for
+    // decryption): one schedule broadcast, or per-block schedules from a slab
+    // sliced through the same transpose as the data.
+    struct OneKey {
+        const uint32_t* rk;
+
+        template <class V, bool Dec>
+        SM4_BS_INLINE void planes(int i, V kp[4][32]) const {
+            const V zero = {};
+            for (int t = 0; t < 4; ++t) {
+                const uint32_t k = rk[Dec ? ROUNDS - 1 - i - t : i + t];
+                for (int j = 0; j < 32; ++j) kp[t][j] = zero - (uint64_t)((k >> j) & 1);
+            }
+        }
+    };
+
+    struct LaneKeys {
+        const uint32_t* slab;
+        const uint32_t* off;
+        size_t n;   // blocks with a key; the padding lanes reuse block 0's
+
+        template <class V, bool Dec>
+        SM4_BS_INLINE void planes(int i, V kp[4][32]) const {
+            const size_t N = sizeof(V) * 8;
+            alignas(32) uint8_t kb[256 * 16];
+            for (size_t b = 0; b < N; ++b) {
+                const uint32_t* k = slab + off[b < n ? b : 0];
+                for (int t = 0; t < 4; ++t) {
+                    const uint32_t w = k[Dec ? ROUNDS - 1 - i - t : i + t];
+                    kb[b * 16 + t * 4] = (uint8_t)(w >> 24);
+                    kb[b * 16 + t * 4 + 1] = (uint8_t)(w >> 16);
+                    kb[b * 16 + t * 4 + 2] = (uint8_t)(w >> 8);
+                    kb[b * 16 + t * 4 + 3] = (uint8_t)w;
+                }
+            }
+            to_planes(kb, kp);
+        }
+    };
+
+    template <class V, bool Dec, class Keys>
+    static SM4_BS_INLINE void rounds(V X[4][32], const Keys& keys) {
+        V kp[4][32];
+        for (int i = 0; i < ROUNDS; i += 4) {
+            keys.template planes<V, Dec>(i, kp);
+            for (int t = 0; t < 4; ++t) {
+                V* x0 = X[t];
+                const V* x1 = X[(t + 1) & 3];
+                const V* x2 = X[(t + 2) & 3];
+                const V* x3 = X[(t + 3) & 3];
+                V b[32];
+                for (int j = 0; j < 32; ++j) b[j] = x1[j] ^ x2[j] ^ x3[j] ^ kp[t][j];
+                for (int q = 0; q < 4; ++q) sbox(b + 8 * q);
+                // L(B) = B ^ (B <<< 2) ^ (B <<< 10) ^ (B <<< 18) ^ (B <<< 24)
+                for (int j = 0; j < 32; ++j) {
+                    x0[j] ^= b[j] ^ b[(j + 30) & 31] ^ b[(j + 22) & 31] ^ b[(j + 14) & 31] ^ b[(j + 8) & 31];
+                }
+            }
+        }
+    }
+
+    static void transpose16(__m128i r[16]) {
+        for (int stage = 0; stage < 4; ++stage) {
+            __m128i t[16];
+            for (int i = 0; i < 8; ++i) {
+                t[2 * i] = _mm_unpacklo_epi8(r[i], r[i + 8]);
+                t[2 * i + 1] = _mm_unpackhi_epi8(r[i], r[i + 8]);
+            }
+            for (int i = 0; i < 16; ++i) r[i] = t[i];
+        }
+    }
+
+    // State word w is big-endian, so bit `bit` of byte p lands in plane
+    // 32 * (p / 4) + 8 * (3 - p % 4) + bit.
+    static int plane(int p, int bit) {
+        return 32 * (p >> 2) + 8 * (3 - (p & 3)) + bit;
+    }
+
+    // 16 blocks at a time: after the byte transpose, row p holds byte p of
+    // the 16 blocks and each PMOVMSKB peels off one bit plane of it.
+    template <class V>
+    static SM4_BS_INLINE void to_planes(const uint8_t* in, V X[4][32]) {
+        const int G = sizeof(V) / 2;
+        uint8_t* P = (uint8_t*)X;
+        for (int g = 0; g < G; ++g) {
+            __m128i r[16];
+            for (int i = 0; i < 16; ++i) r[i] = _mm_loadu_si128((const __m128i*)(in + (g * 16 + i) * 16));
+            transpose16(r);
+            for (int p = 0; p < 16; ++p) {
+                __m128i row = r[p];
+                for (int bit = 7; bit >= 0; --bit) {
+                    const uint16_t m = (uint16_t)_mm_movemask_epi8(row);
+                    memcpy(P + (plane(p, bit) * G + g) * 2, &m, 2);
+                    row = _mm_add_epi8(row, row);
+                }
+            }
+        }
+    }
+
+    // 8x8 transpose of 16-bit words.
+    static SM4_BS_INLINE void transpose8x16(__m128i r[8]) {
+        __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]), a1 = _mm_unpackhi_epi16(r[0], r[1]);
+        __m128i a2 = _mm_unpacklo_epi16(r[2], r[3]), a3 = _mm_unpackhi_epi16(r[2], r[3]);
+        __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]), a5 = _mm_unpackhi_epi16(r[4], r[5]);
+        __m128i a6 = _mm_unpacklo_epi16(r[6], r[7]), a7 = _mm_unpackhi_epi16(r[6], r[7]);
+        __m128i b0 = _mm_unpacklo_epi32(a0, a2), b1 = _mm_unpackhi_epi32(a0, a2);
+        __m128i b2 = _mm_unpacklo_epi32(a1, a3), b3 = _mm_unpackhi_epi32(a1, a3);
+        __m128i b4 = _mm_unpacklo_epi32(a4, a6), b5 = _mm_unpackhi_epi32(a4, a6);
+        __m128i b6 = _mm_unpacklo_epi32(a5, a7), b7 = _mm_unpackhi_epi32(a5, a7);
+        r[0] = _mm_unpacklo_epi64(b0, b4); r[1] = _mm_unpackhi_epi64(b0, b4);
+        r[2] = _mm_unpacklo_epi64(b1, b5); r[3] = _mm_unpackhi_epi64(b1, b5);
+        r[4] = _mm_unpacklo_epi64(b2, b6); r[5] = _mm_unpackhi_epi64(b2, b6);
+        r[6] = _mm_unpacklo_epi64(b3, b7); r[7] = _mm_unpackhi_epi64(b3, b7);
+    }
+
+    // 16-bit lanes -> bytes 0-7 = low halves, bytes 8-15 = high halves
+    static SM4_BS_INLINE __m128i split_bytes(__m128i x) {
+        return _mm_packus_epi16(_mm_and_si128(x, _mm_set1_epi16(0xFF)), _mm_srli_epi16(x, 8));
+    }
+
+    // 8x8 bit-matrix transpose in each 64-bit half (bit i of byte j <-> bit j
+    // of byte i), by three delta swaps.
+    static SM4_BS_INLINE __m128i transpose8x8_bits(__m128i x) {
+        __m128i t = _mm_and_si128(_mm_xor_si128(x, _mm_srli_epi64(x, 7)), _mm_set1_epi64x(0x00AA00AA00AA00AA));
+        x = _mm_xor_si128(x, _mm_xor_si128(t, _mm_slli_epi64(t, 7)));
+        t = _mm_and_si128(_mm_xor_si128(x, _mm_srli_epi64(x, 14)), _mm_set1_epi64x(0x0000CCCC0000CCCC));
+        x = _mm_xor_si128(x, _mm_xor_si128(t, _mm_slli_epi64(t, 14)));
+        t = _mm_and_si128(_mm_xor_si128(x, _mm_srli_epi64(x, 28)), _mm_set1_epi64x(0x00000000F0F0F0F0));
+        return _mm_xor_si128(x, _mm_xor_si128(t, _mm_slli_epi64(t, 28)));
+    }
+
+    // Inverse of to_planes. The 8 planes of byte p are consecutive, so an
+    // 8x8 transpose of 16-bit words hands each group its 8 plane words. Split
+    // into bytes (plane j of blocks 0-7 in byte j, of blocks 8-15 in byte
+    // 8 + j) they are two 8x8 bit matrices whose transposes are exactly row
+    // p; the byte transpose then restores the blocks.
+    template <class V>
+    static SM4_BS_INLINE void from_planes(const V X[4][32], uint8_t* out) {
+        const int G = sizeof(V) / 2;
+        const uint8_t* P = (const uint8_t*)X;
+        for (int o = 0; o < G; o += 8) {
+            __m128i rows[8][16];
+            for (int p = 0; p < 16; ++p) {
+                __m128i r[8];
+                for (int j = 0; j < 8; ++j) {
+                    r[j] = _mm_loadu_si128((const __m128i*)(P + (plane(p, j) * G + o) * 2));
+                }
+                transpose8x16(r);
+                for (int g = 0; g < 8; ++g) rows[g][p] = transpose8x8_bits(split_bytes(r[g]));
+            }
+            for (int g = 0; g < 8; ++g) {
+                transpose16(rows[g]);
+                for (int i = 0; i < 16; ++i) {
+                    _mm_storeu_si128((__m128i*)(out + ((o + g) * 16 + i) * 16), rows[g][i]);
+                }
+            }
+        }
+    }
+
+    template <class V, bool Dec, class Keys>
+    static SM4_BS_INLINE void crypt_sliced(const Keys& keys, const uint8_t* in, uint8_t* out) {
+        alignas(32) V X[4][32];
+        to_planes(in, X);
+        rounds<V, Dec>(X, keys);
+        // the output is (X35, X34, X33, X32): reverse the word order
+        alignas(32) V Y[4][32];
+        for (int w = 0; w < 4; ++w) {
+            for (int j = 0; j < 32; ++j) Y[w][j] = X[3 - w][j];
+        }
+        from_planes(Y, out);
+    }
+
+    template <bool Dec, class Keys>
+    static void crypt128(const Keys& keys, const uint8_t* in, uint8_t* out) {
+        crypt_sliced<sm4_bs128, Dec>(keys, in, out);
+    }
+
+    template <bool Dec, class Keys>
+    SM4_TARGET_AVX2 static void crypt256(const Keys& keys, const uint8_t* in, uint8_t* out) {
+        crypt_sliced<sm4_bs256, Dec>(keys, in, out);
+    }
+
+    // Full batches go straight through; a tail is zero-padded to the
+    // smallest batch that holds it. Work depends only on nblocks.
+    template <bool Dec>
+    void crypt_blocks(const uint32_t* slab, const uint32_t* off,
+        const uint8_t* in, uint8_t* out, size_t nblocks) {
+        const size_t W = use_avx2 ? 256 : 128;
+        while (nblocks > 0) {
+            const size_t n = nblocks < W ? nblocks : W;
+            const bool wide = use_avx2 && n > 128;
+            const size_t N = wide ? 256 : 128;
+            alignas(32) uint8_t tmp[256 * 16];
+            const uint8_t* src = in;
+            uint8_t* dst = out;
+            if (n < N) {
+                memset(tmp, 0, N * 16);
+                memcpy(tmp, in, n * 16);
+                src = dst = tmp;
+            }
+            if (slab) {
+                LaneKeys keys = { slab, off, n };
+                if (wide) crypt256<Dec>(keys, src, dst);
+                else crypt128<Dec>(keys, src, dst);
+                off += n;
+            } else {
+                OneKey keys = { rk };
+                if (wide) crypt256<Dec>(keys, src, dst);
+                else crypt128<Dec>(keys, src, dst);
+            }
+            if (n < N) memcpy(out, tmp, n * 16);
+            in += n * 16; out += n * 16; nblocks -= n;
+        }
+    }
+
+    // tau() of the key schedule on the S-box circuit: bit q of plane i is
+    // bit i of byte q, so one call covers the four bytes of the word.
+    static uint32_t tau_sliced(uint32_t a) {
+        uint32_t x[8];
+        for (int i = 0; i < 8; ++i) {
+            x[i] = 0;
+            for (int q = 0; q < 4; ++q) x[i] |= ((a >> (8 * q + i)) & 1) << q;
+        }
+        sbox(x);
+        uint32_t r = 0;
+        for (int i = 0; i < 8; ++i) {
+            for (int q = 0; q < 4; ++q) r |= ((x[i] >> q) & 1) << (8 * q + i);
+        }
+        return r;
+    }
+
+    static uint32_t rotl(uint32_t x, int n) {
+        return (x << n) | (x >> (32 - n));
+    }
+
+public:
+    // avx2 selects the 256-block ymm kernel; otherwise batches are 128
+    // blocks on SSE2.
+    explicit SM4_Bitslice(bool avx2 = sm4_cpu().avx2) : use_avx2(avx2) {
+    }
+
+    // Same schedule as SM4_TTable::expand_key without the S-box table.
+    static void expand_key(const uint8_t key[16], uint32_t rk[ROUNDS]) {
+        uint32_t K[4];
+        for (int i = 0; i < 4; ++i) {
+            K[i] = ((uint32_t)key[i * 4] << 24) | ((uint32_t)key[i * 4 + 1] << 16) |
+                ((uint32_t)key[i * 4 + 2] << 8) | key[i * 4 + 3];
+            K[i] ^= SM4_FK[i];
+        }
+        for (int i = 0; i < ROUNDS; ++i) {
+            const uint32_t t = tau_sliced(K[(i + 1) % 4] ^ K[(i + 2) % 4] ^ K[(i + 3) % 4] ^ SM4_CK[i]);
+            rk[i] = K[i % 4] ^ t ^ rotl(t, 13) ^ rotl(t, 23);
+            K[i % 4] = rk[i];
+        }
+    }
+
+    void set_key(const uint8_t key[16]) {
+        expand_key(key, rk);
+    }
+
+    // A single block costs a whole 128-block batch; this backend is meant for
+    // bulk traffic.
+    void encrypt(const uint8_t in[16], uint8_t out[16]) {
+        crypt_blocks<false>(nullptr, nullptr, in, out, 1);
+    }
+
+    void decrypt(const uint8_t in[16], uint8_t out[16]) {
+        crypt_blocks<true>(nullptr, nullptr, in, out, 1);
+    }
+
+    void encrypt_blocks(const uint8_t* in, uint8_t* out, size_t nblocks) {
+        crypt_blocks<false>(nullptr, nullptr, in, out, nblocks);
+    }
+
+    void decrypt_blocks(const uint8_t* in, uint8_t* out, size_t nblocks) {
+        crypt_blocks<true>(nullptr, nullptr, in, out, nblocks);
+    }
+
+    void encrypt_blocks_multikey(const uint32_t* slab, const uint32_t* off,
+        const uint8_t* in, uint8_t* out, size_t nblocks) {
+        crypt_blocks<false>(slab, off, in, out, nblocks);
+    }
+
+    void decrypt_blocks_multikey(const uint32_t* slab, const uint32_t* off,
+        const uint8_t* in, uint8_t* out, size_t nblocks) {
+        crypt_blocks<true>(slab, off, in, out, nblocks);
+    }
+};
+#endif
+
+
+// Known-answer test run on a backend before it is enabled: the GB/T 32907
+// example vector, then multi-block runs (one key, then per-block keys)
+// against the reference T-table that exercise the 16/8/4-wide kernels and
+// the partial tail.
+template <class Cipher>
+bool sm4_self_test(Cipher& cipher) {
+    static const uint8_t key[16] = {
+        0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF, 0xFE, 0xDC, 0xBA, 0x98, 0x76, 0x54, 0x32, 0x10
+    };
+    static const uint8_t expected[16] = {
+        0x68, 0x1E, 0xDF, 0x34, 0xD2, 0x06, 0x96, 0x5E, 0x86, 0xB3, 0xE9, 0x4F, 0x53, 0x6E, 0x42, 0x46
+    };
+    uint8_t out[16], back[16];
+    cipher.set_key(key);
+    cipher.encrypt(key, out);
+    cipher.decrypt(out, back);
+    if (memcmp(out, expected, 16) != 0 || memcmp(back, key, 16) != 0) {
+        return false;
+    }
+
+    const size_t N = 31;
+    uint8_t in[N * 16], ref[N * 16], got[N * 16];
+    for (size_t i = 0; i < sizeof(in); ++i) {
+        in[i] = (uint8_t)(i * 131 + 7);
+    }
+    SM4_TTable ttable;
+    ttable.set_key(key);
+    ttable.encrypt_blocks(in, ref, N);
+    cipher.encrypt_blocks(in, got, N);
+    if (memcmp(got, ref, sizeof(ref)) != 0) {
+        return false;
+    }
+    cipher.decrypt_blocks(ref, got, N);
+    if (memcmp(got, in, sizeof(in)) != 0) {
+        return false;
+    }
+
+    // per-lane keys: blocks alternate between two schedules in one slab
+    uint32_t slab[2 * ROUNDS], off[N];
+    SM4_TTable::expand_key(key, slab);
+    SM4_TTable::expand_key(expected, slab + ROUNDS);
+    for (size_t b = 0; b < N; ++b) {
+        off[b] = (b % 3 == 1) ? ROUNDS : 0;
+    }
+    ttable.encrypt_blocks_multikey(slab, off, in, ref, N);
+    cipher.encrypt_blocks_multikey(slab, off, in, got, N);
+    if (memcmp(got, ref, sizeof(ref)) != 0) {
+        return false;
+    }
+    cipher.decrypt_blocks_multikey(slab, off, ref, got, N);
+    return memcmp(got, in, sizeof(in)) == 0;
+}
+
+
+// Single SM4 front-end for mixed fleets: the first use probes the CPU,
+// self-tests the candidates from fastest to slowest and keeps the first one
+// that passes; the T-table is the portable fallback. The bitsliced backend
+// is never picked automatically (a single block costs a full batch); ask
+// for it explicitly where constant time matters and traffic is bulk.
+class SM4_Dispatch {
+public:
+    enum Backend {
+        BACKEND_TTABLE,
+        BACKEND_AESNI,
+        BACKEND_AESNI_AVX2,
+        BACKEND_GFNI_AVX512,
+        BACKEND_BITSLICE,
+        BACKEND_COUNT
+    };
+
+    SM4_Dispatch() : SM4_Dispatch(selected()) {
+    }
+
+    // Uses backend b if the host runs it and it passes its self-test,
+    // otherwise the automatic choice.
+    explicit SM4_Dispatch(Backend b) : active(available(b) ? b : selected())
+#ifdef SM4_HAVE_X86
+        , aesni(active == BACKEND_AESNI_AVX2)
+#endif
+    {
+    }
+
+    static Backend selected() {
+        static const Backend b = select_backend();
+        return b;
+    }
+
+    static bool available(Backend b) {
+        static const std::array<bool, BACKEND_COUNT> ok = probe_backends();
+        return b >= 0 && b < BACKEND_COUNT && ok[b];
+    }
+
+    static const char* backend_name(Backend b) {
+        switch (b) {
+        case BACKEND_AESNI: return "AES-NI";
+        case BACKEND_AESNI_AVX2: return "AES-NI/AVX2";
+        case BACKEND_GFNI_AVX512: return "GFNI/AVX-512";
+        case BACKEND_BITSLICE: return "Bitsliced";
+        default: return "T-table";
+        }
+    }
+
+    Backend backend() const {
+        return active;
+    }
+
+    void set_key(const uint8_t key[16]) {
+        switch (active) {
+#ifdef SM4_HAVE_X86
+        case BACKEND_AESNI:
+        case BACKEND_AESNI_AVX2: aesni.set_key(key); break;
+        case BACKEND_GFNI_AVX512: gfni.set_key(key); break;
+        case BACKEND_BITSLICE: bitslice.set_key(key); break;
+#endif
+        default: ttable.set_key(key); break;
+        }
     }
 
     void encrypt(const uint8_t in[16], uint8_t out[16]) {
-        uint8_t tmp_in[64] = { 0 };
-        uint8_t tmp_out[64] = { 0 };
-        memcpy(tmp_in, in, 16);
-        encrypt_4blocks(tmp_in, tmp_out);
-        memcpy(out, tmp_out, 16);
+        encrypt_blocks(in, out, 1);
+    }
+
+    void decrypt(const uint8_t in[16], uint8_t out[16]) {
+        decrypt_blocks(in, out, 1);
+    }
+
+    void encrypt_blocks(const uint8_t* in, uint8_t* out, size_t nblocks) {
+        switch (active) {
+#ifdef SM4_HAVE_X86
+        case BACKEND_AESNI:
+        case BACKEND_AESNI_AVX2: aesni.encrypt_blocks(in, out, nblocks); break;
+        case BACKEND_GFNI_AVX512: gfni.encrypt_blocks(in, out, nblocks); break;
+        case BACKEND_BITSLICE: bitslice.encrypt_blocks(in, out, nblocks); break;
+#endif
+        default: ttable.encrypt_blocks(in, out, nblocks); break;
+        }
+    }
+
+    void decrypt_blocks(const uint8_t* in, uint8_t* out, size_t nblocks) {
+        switch (active) {
+#ifdef SM4_HAVE_X86
+        case BACKEND_AESNI:
+        case BACKEND_AESNI_AVX2: aesni.decrypt_blocks(in, out, nblocks); break;
+        case BACKEND_GFNI_AVX512: gfni.decrypt_blocks(in, out, nblocks); break;
+        case BACKEND_BITSLICE: bitslice.decrypt_blocks(in, out, nblocks); break;
+#endif
+        default: ttable.decrypt_blocks(in, out, nblocks); break;
+        }
+    }
+
+    // Per-block keys from a slab of schedules; independent of set_key().
+    void encrypt_blocks_multikey(const uint32_t* slab, const uint32_t* off,
+        const uint8_t* in, uint8_t* out, size_t nblocks) {
+        switch (active) {
+#ifdef SM4_HAVE_X86
+        case BACKEND_AESNI:
+        case BACKEND_AESNI_AVX2: aesni.encrypt_blocks_multikey(slab, off, in, out, nblocks); break;
+        case BACKEND_GFNI_AVX512: gfni.encrypt_blocks_multikey(slab, off, in, out, nblocks); break;
+        case BACKEND_BITSLICE: bitslice.encrypt_blocks_multikey(slab, off, in, out, nblocks); break;
+#endif
+        default: ttable.encrypt_blocks_multikey(slab, off, in, out, nblocks); break;
+        }
+    }
+
+    void decrypt_blocks_multikey(const uint32_t* slab, const uint32_t* off,
+        const uint8_t* in, uint8_t* out, size_t nblocks) {
+        switch (active) {
+#ifdef SM4_HAVE_X86
+        case BACKEND_AESNI:
+        case BACKEND_AESNI_AVX2: aesni.decrypt_blocks_multikey(slab, off, in, out, nblocks); break;
+        case BACKEND_GFNI_AVX512: gfni.decrypt_blocks_multikey(slab, off, in, out, nblocks); break;
+        case BACKEND_BITSLICE: bitslice.decrypt_blocks_multikey(slab, off, in, out, nblocks); break;
+#endif
+        default: ttable.decrypt_blocks_multikey(slab, off, in, out, nblocks); break;
+        }
+    }
+
+private:
+    Backend active;
+    SM4_TTable ttable;
+#ifdef SM4_HAVE_X86
+    SM4_AESNI aesni;
+    SM4_GFNI_AVX512 gfni;
+    SM4_Bitslice bitslice;
+#endif
+
+    static std::array<bool, BACKEND_COUNT> probe_backends() {
+        std::array<bool, BACKEND_COUNT> ok = {};
+        ok[BACKEND_TTABLE] = true;
+#ifdef SM4_HAVE_X86
+        const SM4_CpuInfo& cpu = sm4_cpu();
+        if (cpu.gfni_avx512) {
+            SM4_GFNI_AVX512 c;
+            ok[BACKEND_GFNI_AVX512] = sm4_self_test(c);
+        }
+        if (cpu.aesni && cpu.avx2) {
+            SM4_AESNI c(true);
+            ok[BACKEND_AESNI_AVX2] = sm4_self_test(c);
+        }
+        if (cpu.aesni) {
+            SM4_AESNI c(false);
+            ok[BACKEND_AESNI] = sm4_self_test(c);
+        }
+        SM4_Bitslice c;
+        ok[BACKEND_BITSLICE] = sm4_self_test(c);
+#endif
+        return ok;
+    }
+
+    static Backend select_backend() {
+        const Backend order[] = { BACKEND_GFNI_AVX512, BACKEND_AESNI_AVX2, BACKEND_AESNI };
+        for (Backend b : order) {
+            if (available(b)) return b;
+        }
+        return BACKEND_TTABLE;
     }
 };
+
+
+// Key schedules of n keys (16 bytes each, contiguous) for rekeying many
+// sessions at once: enc_rk receives n schedules of ROUNDS words in encryption
+// order and dec_rk, if not null, the same schedules reversed. Keys are
+// lane-sliced 16 or 8 at a time on the GFNI and AES-NI/AVX2 backends and
+// expanded one by one otherwise.
+static void sm4_expand_keys(const uint8_t* keys, size_t n, uint32_t* enc_rk, uint32_t* dec_rk = nullptr) {
+    size_t lanes = 1;
+#ifdef SM4_HAVE_X86
+    switch (SM4_Dispatch::selected()) {
+    case SM4_Dispatch::BACKEND_GFNI_AVX512: lanes = 16; break;
+    case SM4_Dispatch::BACKEND_AESNI_AVX2: lanes = 8; break;
+    default: break;
+    }
+#endif
+
+    while (n > 0) {
+        const size_t m = n < lanes ? n : lanes;
+        if (lanes == 1) {
+            SM4_TTable::expand_key(keys, enc_rk);
+            if (dec_rk) {
+                for (int i = 0; i < ROUNDS; ++i) dec_rk[i] = enc_rk[ROUNDS - 1 - i];
+            }
+        }
+#ifdef SM4_HAVE_X86
+        else {
+            // a short last batch runs through zero-padded buffers
+            alignas(64) uint8_t kbuf[16 * 16];
+            alignas(64) uint32_t ebuf[16 * ROUNDS], dbuf[16 * ROUNDS];
+            const uint8_t* k = keys;
+            uint32_t* e = enc_rk;
+            uint32_t* d = dec_rk;
+            if (m < lanes) {
+                memset(kbuf, 0, sizeof(kbuf));
+                memcpy(kbuf, keys, m * 16);
+                k = kbuf; e = ebuf; d = dec_rk ? dbuf : nullptr;
+            }
+            if (lanes == 16) SM4_GFNI_AVX512::expand_keys16(k, e, d);
+            else SM4_AESNI::expand_keys8(k, e, d);
+            if (m < lanes) {
+                memcpy(enc_rk, ebuf, m * ROUNDS * sizeof(uint32_t));
+                if (dec_rk) memcpy(dec_rk, dbuf, m * ROUNDS * sizeof(uint32_t));
+            }
+        }
 #endif
+        keys += m * 16;
+        enc_rk += m * ROUNDS;
+        if (dec_rk) dec_rk += m * ROUNDS;
+        n -= m;
+    }
+}
+
+
+// Persistent worker threads for the bulk modes. run() hands out job indices
+// [0, njobs) to the workers and the calling thread and returns once every job
+// has finished; one run() at a time per pool.
+class SM4_WorkerPool {
+public:
+    explicit SM4_WorkerPool(unsigned nthreads = std::thread::hardware_concurrency()) {
+        if (nthreads == 0) nthreads = 1;
+        for (unsigned i = 1; i < nthreads; ++i) {
+            workers.emplace_back([this] { worker_loop(); });
+        }
+    }
+
+    ~SM4_WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& t : workers) t.join();
+    }
+
+    unsigned size() const {
+        return (unsigned)workers.size() + 1;
+    }
+
+    void run(size_t njobs, const std::function<void(size_t)>& fn) {
+        if (njobs == 0) return;
+        if (workers.empty() || njobs == 1) {
+            for (size_t i = 0; i < njobs; ++i) fn(i);
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mtx);
+        job = &fn;
+        total = njobs;
+        next.store(0);
+        busy = workers.size();
+        ++generation;
+        lock.unlock();
+        wake.notify_all();
+
+        drain();
+
+        lock.lock();
+        done.wait(lock, [this] { return busy == 0; });
+        job = nullptr;
+    }
+
+    static SM4_WorkerPool& shared() {
+        static SM4_WorkerPool pool;
+        return pool;
+    }
+
+private:
+    std::vector<std::thread> workers;
+    std::mutex mtx;
+    std::condition_variable wake, done;
+    const std::function<void(size_t)>* job = nullptr;
+    size_t total = 0;
+    std::atomic<size_t> next{ 0 };
+    size_t busy = 0;
+    uint64_t generation = 0;
+    bool stopping = false;
+
+    void drain() {
+        for (size_t i = next.fetch_add(1); i < total; i = next.fetch_add(1)) {
+            (*job)(i);
+        }
+    }
+
+    void worker_loop() {
+        uint64_t seen = 0;
+        for (;;) {
+            std::unique_lock<std::mutex> lock(mtx);
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            lock.unlock();
+
+            drain();
+
+            lock.lock();
+            if (--busy == 0) done.notify_one();
+        }
+    }
+};
 
 
+// Quick smoke run over the backends. For comparable numbers (random input,
+// calibrated repetitions, every backend x mode x size, JSON output) use the
+// suite in 1j.cpp.
 void benchmark_sm4() {
     
     uint8_t key[16] = { 0x01,0x23,0x45,0x67,0x89,0xab,0xcd,0xef,0xfe,0xdc,0xba,0x98,0x76,0x54,0x32,0x10 };
-    uint8_t plain[16] = { 0x01,0x23,0x45,0x67,0x89,0xab,0xcd,0xef,0xfe,0xdc,0xba,0x98,0x76,0x54,0x32,0x10 };
-    uint8_t cipher[16];
 
-    
+    // 1M single-block calls, each encrypting the previous ciphertext: the
+    // input changes every call and nothing can be hoisted out of the loop,
+    // so this is the latency of one block.
+    auto single_block_ms = [](auto& cipher) {
+        uint8_t block[16] = { 0x01,0x23,0x45,0x67,0x89,0xab,0xcd,0xef,0xfe,0xdc,0xba,0x98,0x76,0x54,0x32,0x10 };
+        auto t0 = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < 1000000; i++) {
+            cipher.encrypt(block, block);
+        }
+        auto t1 = std::chrono::high_resolution_clock::now();
+        asm volatile("" : : "r"(block) : "memory"); // the result is live
+        return std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count();
+    };
+
     SM4_Basic sm4_basic;
     sm4_basic.set_key(key);
+    std::cout << "Basic SM4 (1M chained blocks): " << single_block_ms(sm4_basic) << " ms" << std::endl;
+
+    SM4_TTable sm4_ttable;
+    sm4_ttable.set_key(key);
+    std::cout << "T-table SM4 (1M chained blocks): " << single_block_ms(sm4_ttable) << " ms" << std::endl;
 
+    std::vector<uint8_t> buf(16 * 1000000), buf_out(buf.size());
+    for (size_t i = 0; i < buf.size(); ++i) buf[i] = (uint8_t)(i * 2654435761u >> 13);
+    uint8_t ctr[16] = { 0 };
     auto start = std::chrono::high_resolution_clock::now();
-    for (int i = 0; i < 1000000; i++) {
-        sm4_basic.encrypt(plain, cipher);
-    }
+    sm4_ctr_crypt(sm4_ttable, ctr, buf.data(), buf_out.data(), buf.size());
     auto end = std::chrono::high_resolution_clock::now();
-    std::cout << "Basic SM4: "
+    std::cout << "T-table SM4 CTR (1000000 blocks): "
         << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
         << " ms" << std::endl;
 
- 
-    SM4_TTable sm4_ttable;
-    sm4_ttable.set_key(key);
-
+    // 4 KB vs 1 KB tables, alone and with 44 KB of unrelated data touched
+    // after every 1 KB of CTR output (a cipher sharing L1 with other work)
+    SM4_TTable1K sm4_ttable1k;
+    sm4_ttable1k.set_key(key);
+    memset(ctr, 0, sizeof(ctr));
     start = std::chrono::high_resolution_clock::now();
-    for (int i = 0; i < 1000000; i++) {
-        sm4_ttable.encrypt(plain, cipher);
-    }
+    sm4_ctr_crypt(sm4_ttable1k, ctr, buf.data(), buf_out.data(), buf.size());
     end = std::chrono::high_resolution_clock::now();
-    std::cout << "T-table SM4: "
+    std::cout << "T-table 1 KB SM4 CTR (1000000 blocks): "
         << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
         << " ms" << std::endl;
 
-   
-#ifdef __AES__
-    SM4_AESNI sm4_aesni;
-    sm4_aesni.set_key(key);
-
+    std::vector<uint32_t> other(11 * 1024);
+    auto ctr_with_pressure = [&](auto& cipher) {
+        uint8_t c[16] = { 0 };
+        auto t0 = std::chrono::high_resolution_clock::now();
+        for (size_t off = 0; off < buf.size(); off += 1024) {
+            sm4_ctr_crypt(cipher, c, buf.data() + off, buf_out.data() + off, 1024);
+            for (size_t i = 0; i < other.size(); i += 16) other[i] += 1;
+        }
+        auto t1 = std::chrono::high_resolution_clock::now();
+        return std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count();
+    };
+    SM4_Dispatch sm4_bitslice(SM4_Dispatch::BACKEND_BITSLICE);
+    sm4_bitslice.set_key(key);
+    memset(ctr, 0, sizeof(ctr));
     start = std::chrono::high_resolution_clock::now();
-    for (int i = 0; i < 1000000; i++) {
-        sm4_aesni.encrypt(plain, cipher);
-    }
+    sm4_ctr_crypt(sm4_bitslice, ctr, buf.data(), buf_out.data(), buf.size());
     end = std::chrono::high_resolution_clock::now();
-    std::cout << "AES-NI SM4: "
+    std::cout << SM4_Dispatch::backend_name(sm4_bitslice.backend()) << " (constant-time) SM4 CTR (1000000 blocks): "
         << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
         << " ms" << std::endl;
+
+    std::cout << "T-table 4 KB vs 1 KB SM4 CTR with L1 pressure (1000000 blocks): "
+        << ctr_with_pressure(sm4_ttable) << " ms vs " << ctr_with_pressure(sm4_ttable1k)
+        << " ms" << std::endl;
+
+   
+#ifdef SM4_HAVE_X86
+    if (sm4_cpu().aesni) {
+        SM4_AESNI sm4_aesni;
+        sm4_aesni.set_key(key);
+        std::cout << "AES-NI SM4 (1M chained blocks): " << single_block_ms(sm4_aesni) << " ms" << std::endl;
+
+        memset(ctr, 0, sizeof(ctr));
+        start = std::chrono::high_resolution_clock::now();
+        sm4_ctr_crypt(sm4_aesni, ctr, buf.data(), buf_out.data(), buf.size());
+        end = std::chrono::high_resolution_clock::now();
+        std::cout << "AES-NI SM4 CTR (1000000 blocks): "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
+            << " ms" << std::endl;
+    }
 #endif
 
     
-#if defined(__GFNI__) && defined(__AVX512F__)
-    SM4_GFNI_AVX512 sm4_gfni;
-    sm4_gfni.set_key(key);
+#ifdef SM4_HAVE_X86
+    if (sm4_cpu().gfni_avx512) {
+        SM4_GFNI_AVX512 sm4_gfni;
+        sm4_gfni.set_key(key);
+        std::cout << "GFNI+AVX512 SM4 (1M chained blocks): " << single_block_ms(sm4_gfni) << " ms" << std::endl;
 
-    
-    uint8_t plain4[64];
-    uint8_t cipher4[64];
-    for (int i = 0; i < 4; i++) {
-        memcpy(plain4 + i * 16, plain, 16);
+        memset(ctr, 0, sizeof(ctr));
+        start = std::chrono::high_resolution_clock::now();
+        sm4_ctr_crypt(sm4_gfni, ctr, buf.data(), buf_out.data(), buf.size());
+        end = std::chrono::high_resolution_clock::now();
+        std::cout << "GFNI+AVX512 SM4 CTR (1000000 blocks): "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
+            << " ms" << std::endl;
     }
+#endif
 
+    SM4_Dispatch sm4_dispatch;
+    sm4_dispatch.set_key(key);
+
+    memset(ctr, 0, sizeof(ctr));
     start = std::chrono::high_resolution_clock::now();
-    for (int i = 0; i < 250000; i++) { // 1000000/4=250000
-        sm4_gfni.encrypt_4blocks(plain4, cipher4);
-    }
+    sm4_ctr_crypt(sm4_dispatch, ctr, buf.data(), buf_out.data(), buf.size());
     end = std::chrono::high_resolution_clock::now();
-    std::cout << "GFNI+AVX512 SM4 (4 blocks): "
+    std::cout << "Dispatch (" << SM4_Dispatch::backend_name(sm4_dispatch.backend())
+        << ") SM4 CTR (1000000 blocks): "
         << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
         << " ms" << std::endl;
-#endif
+
+    memset(ctr, 0, sizeof(ctr));
+    start = std::chrono::high_resolution_clock::now();
+    sm4_cbc_decrypt(sm4_dispatch, ctr, buf.data(), buf_out.data(), buf.size() / 16);
+    end = std::chrono::high_resolution_clock::now();
+    std::cout << "Dispatch (" << SM4_Dispatch::backend_name(sm4_dispatch.backend())
+        << ") SM4 CBC decrypt (1000000 blocks): "
+        << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
+        << " ms" << std::endl;
+
+    // Rekeying: 100000 keys one at a time vs. the lane-sliced batch schedule.
+    const size_t NKEYS = 100000;
+    std::vector<uint8_t> keys(NKEYS * 16);
+    std::vector<uint32_t> enc_rk(NKEYS * ROUNDS), dec_rk(NKEYS * ROUNDS), ref_rk(NKEYS * ROUNDS);
+    for (size_t i = 0; i < keys.size(); ++i) keys[i] = (uint8_t)(i * 151 + 3);
+
+    start = std::chrono::high_resolution_clock::now();
+    for (size_t k = 0; k < NKEYS; ++k) {
+        SM4_TTable::expand_key(&keys[k * 16], &ref_rk[k * ROUNDS]);
+    }
+    end = std::chrono::high_resolution_clock::now();
+    std::cout << "Scalar key schedule (100000 keys): "
+        << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()
+        << " us" << std::endl;
+
+    start = std::chrono::high_resolution_clock::now();
+    sm4_expand_keys(keys.data(), NKEYS, enc_rk.data(), dec_rk.data());
+    end = std::chrono::high_resolution_clock::now();
+    bool same = enc_rk == ref_rk;
+    for (size_t k = 0; k < NKEYS && same; ++k) {
+        for (int i = 0; i < ROUNDS; ++i) same &= dec_rk[k * ROUNDS + i] == ref_rk[k * ROUNDS + ROUNDS - 1 - i];
+    }
+    std::cout << "Batch key schedule, enc + dec (100000 keys): "
+        << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()
+        << " us" << (same ? "" : " MISMATCH") << std::endl;
 }
 
+#ifndef SM4_BENCH_NO_MAIN
 int main() {
     benchmark_sm4();
     return 0;
 }
-
-
-const uint8_t SM4_TTable::S_BOX[256] = {
-    0xD6, 0x90, 0xE9, 0xFE, 0xCC, 0xE1, 0x3D, 0xB7, 0x16, 0xB6, 0x14, 0xC2, 0x28, 0xFB, 0x2C, 0x05,
-    0x2B, 0x67, 0x9A, 0x76, 0x2A, 0xBE, 0x04, 0xC3, 0xAA, 0x44, 0x13, 0x26, 0x49, 0x86, 0x06, 0x99,
-    0x9C, 0x42, 0x50, 0xF4, 0x91, 0xEF, 0x98, 0x7A, 0x33, 0x54, 0x0B, 0x43, 0xED, 0xCF, 0xAC, 0x62,
-    0xE4, 0xB3, 0x1C, 0xA9, 0xC9, 0x08, 0xE8, 0x95, 0x80, 0xDF, 0x94, 0xFA, 0x75, 0x8F, 0x3F, 0xA6,
-    0x47, 0x07, 0xA7, 0xFC, 0xF3, 0x73, 0x17, 0xBA, 0x83, 0x59, 0x3C, 0x19, 0xE6, 0x85, 0x4F, 0xA8,
-    0x68, 0x6B, 0x81, 0xB2, 0x71, 0x64, 0xDA, 0x8B, 0xF8, 0xEB, 0x0F, 0x4B, 0x70, 0x56, 0x9D, 0x35,
-    0x1E, 0x24, 0x0E, 0x5E, 0x63, 0x58, 0xD1, 0xA2, 0x25, 0x22, 0x7C, 0x3B, 0x01, 0x21, 0x78, 0x87,
-    0xD4, 0x00, 0x46, 0x57, 0x9F, 0xD3, 0x27, 0x52, 0x4C, 0x36, 0x02, 0xE7, 0xA0, 0xC4, 0xC8, 0x9E,
-    0xEA, 0xBF, 0x8A, 0xD2, 0x40, 0xC7, 0x38, 0xB5, 0xA3, 0xF7, 0xF2, 0xCE, 0xF9, 0x61, 0x15, 0xA1,
-    0xE0, 0xAE, 0x5D, 0xA4, 0x9B, 0x34, 0x1A, 0x55, 0xAD, 0x93, 0x32, 0x30, 0xF5, 0x8C, 0xB1, 0xE3,
-    0x1D, 0xF6, 0xE2, 0x2E, 0x82, 0x66, 0xCA, 0x60, 0xC0, 0x29, 0x23, 0xAB, 0x0D, 0x53, 0x4E, 0x6F,
-    0xD5, 0xDB, 0x37, 0x45, 0xDE, 0xFD, 0x8E, 0x2F, 0x03, 0xFF, 0x6A, 0x72, 0x6D, 0x6C, 0x5B, 0x51,
-    0x8D, 0x1B, 0xAF, 0x92, 0xBB, 0xDD, 0xBC, 0x7F, 0x11, 0xD9, 0x5C, 0x41, 0x1F, 0x10, 0x5A, 0xD8,
-    0x0A, 0xC1, 0x31, 0x88, 0xA5, 0xCD, 0x7B, 0xBD, 0x2D, 0x74, 0xD0, 0x12, 0xB8, 0xE5, 0xB4, 0xB0,
-    0x89, 0x69, 0x97, 0x4A, 0x0C, 0x96, 0x77, 0x7E, 0x65, 0xB9, 0xF1, 0x09, 0xC5, 0x6E, 0xC6, 0x84,
-    0x18, 0xF0, 0x7D, 0xEC, 0x3A, 0xDC, 0x4D, 0x20, 0x79, 0xEE, 0x5F, 0x3E, 0xD7, 0xCB, 0x39, 0x48
-};
-
-const uint32_t SM4_TTable::FK[4] = {
-    0xA3B1BAC6, 0x56AA3350, 0x677D9197, 0xB27022DC
-};
-
-const uint32_t SM4_TTable::CK[32] = {
-    0x00070e15, 0x1c232a31, 0x383f464d, 0x545b6269,
-    0x70777e85, 0x8c939aa1, 0xa8afb6bd, 0xc4cbd2d9,
-    0xe0e7eef5, 0xfc030a11, 0x181f262d, 0x343b4249,
-    0x50575e65, 0x6c737a81, 0x888f969d, 0xa4abb2b9,
-    0xc0c7ced5, 0xdce3eaf1, 0xf8ff060d, 0x141b2229,
-    0x30373e45, 0x4c535a61, 0x686f767d, 0x848b9299,
-    0xa0a7aeb5, 0xbcc3cad1, 0xd8dfe6ed, 0xf4fb0209,
-    0x10171e25, 0x2c333a41, 0x484f565d, 0x646b7279
-};
\ No newline at end of file
+#endif
+#endif // SM4_OPT_INCLUDED
\ No newline at end of file
@@ -0,0 +1,234 @@
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <vector>
+#include <chrono>
+#define SM4_BENCH_NO_MAIN
+#include "1b.cpp"
+
+// SM4-XTS for sector encryption (IEEE 1619 construction with SM4 as the block
+// cipher). Key1 encrypts data, key2 encrypts the sector number into the
+// initial tweak. Tweaks for a run of blocks are doubled in GF(2^128) into a
+// buffer first, so the data itself goes through the bulk SM4 kernels as
+// xor / encrypt_blocks / xor. A sector that is not a multiple of 16 bytes uses
+// ciphertext stealing on its last two blocks only.
+//
+// Sectors are independent, so encrypt()/decrypt() split a large request into
+// sector ranges and run them on a worker pool.
+
+class SM4_XTS {
+public:
+    static const size_t BATCH_BLOCKS = 64;
+    static const size_t MIN_JOB_BYTES = 64 * 1024;
+
+    // Both ciphers run on backend b (the automatic choice by default).
+    explicit SM4_XTS(SM4_Dispatch::Backend b = SM4_Dispatch::selected()) : data_cipher(b), tweak_cipher(b) {
+    }
+
+    void set_key(const uint8_t key1[16], const uint8_t key2[16]) {
+        data_cipher.set_key(key1);
+        tweak_cipher.set_key(key2);
+    }
+
+    // Sector i of the request is numbered first_sector + i; the last sector may
+    // be shorter than sector_size. Returns false if a sector is under 16 bytes.
+    bool encrypt(uint64_t first_sector, size_t sector_size, const uint8_t* in, uint8_t* out, size_t len,
+        SM4_WorkerPool& pool = SM4_WorkerPool::shared()) {
+        return crypt<true>(first_sector, sector_size, in, out, len, pool);
+    }
+
+    bool decrypt(uint64_t first_sector, size_t sector_size, const uint8_t* in, uint8_t* out, size_t len,
+        SM4_WorkerPool& pool = SM4_WorkerPool::shared()) {
+        return crypt<false>(first_sector, sector_size, in, out, len, pool);
+    }
+
+    bool encrypt_sector(uint64_t sector, const uint8_t* in, uint8_t* out, size_t len) {
+        if (len < 16) return false;
+        uint8_t tweak[16];
+        sector_tweaks(sector, 1, tweak);
+        crypt_sector<true>(tweak, in, out, len);
+        return true;
+    }
+
+    bool decrypt_sector(uint64_t sector, const uint8_t* in, uint8_t* out, size_t len) {
+        if (len < 16) return false;
+        uint8_t tweak[16];
+        sector_tweaks(sector, 1, tweak);
+        crypt_sector<false>(tweak, in, out, len);
+        return true;
+    }
+
+private:
+    SM4_Dispatch data_cipher;
+    SM4_Dispatch tweak_cipher;
+
+    // The tweak is a little-endian 128-bit value; doubling shifts it left by
+    // one bit and folds the carry back with x^7 + x^2 + x + 1.
+    static inline void xts_double(uint64_t& lo, uint64_t& hi) {
+        uint64_t carry = hi >> 63;
+        hi = (hi << 1) | (lo >> 63);
+        lo = (lo << 1) ^ (0x87 & (0 - carry));
+    }
+
+    // Encrypted initial tweaks of count consecutive sectors, in one bulk call.
+    void sector_tweaks(uint64_t first_sector, size_t count, uint8_t* tweaks) {
+        memset(tweaks, 0, count * 16);
+        for (size_t i = 0; i < count; ++i) {
+            uint64_t s = first_sector + i;
+            for (int b = 0; b < 8; ++b) {
+                tweaks[i * 16 + b] = (uint8_t)(s >> (8 * b));
+            }
+        }
+        tweak_cipher.encrypt_blocks(tweaks, tweaks, count);
+    }
+
+    void crypt_one(bool enc, const uint8_t in[16], uint8_t out[16], const uint8_t tweak[16]) {
+        uint8_t buf[16];
+        sm4_xor(buf, in, tweak, 16);
+        if (enc) data_cipher.encrypt(buf, buf);
+        else data_cipher.decrypt(buf, buf);
+        sm4_xor(out, buf, tweak, 16);
+    }
+
+    template <bool Enc>
+    void crypt_sector(const uint8_t tweak[16], const uint8_t* in, uint8_t* out, size_t len) {
+        const size_t tail = len % 16;
+        // with stealing, the last full block is handled together with the tail
+        const size_t nbulk = len / 16 - (tail ? 1 : 0);
+        alignas(64) uint8_t tw[BATCH_BLOCKS * 16];
+        alignas(64) uint8_t buf[BATCH_BLOCKS * 16];
+
+        uint64_t lo, hi;
+        memcpy(&lo, tweak, 8);
+        memcpy(&hi, tweak + 8, 8);
+
+        for (size_t done = 0; done < nbulk;) {
+            size_t n = nbulk - done < BATCH_BLOCKS ? nbulk - done : BATCH_BLOCKS;
+            for (size_t b = 0; b < n; ++b) {
+                memcpy(tw + b * 16, &lo, 8);
+                memcpy(tw + b * 16 + 8, &hi, 8);
+                xts_double(lo, hi);
+            }
+            sm4_xor(buf, in + done * 16, tw, n * 16);
+            if (Enc) data_cipher.encrypt_blocks(buf, buf, n);
+            else data_cipher.decrypt_blocks(buf, buf, n);
+            sm4_xor(out + done * 16, buf, tw, n * 16);
+            done += n;
+        }
+
+        if (tail) {
+            uint8_t t_prev[16], t_last[16], last[16], stolen[16];
+            memcpy(t_prev, &lo, 8);
+            memcpy(t_prev + 8, &hi, 8);
+            xts_double(lo, hi);
+            memcpy(t_last, &lo, 8);
+            memcpy(t_last + 8, &hi, 8);
+
+            const uint8_t* in_full = in + nbulk * 16;
+            uint8_t* out_full = out + nbulk * 16;
+            memcpy(last, in_full + 16, tail);
+            // encryption pairs the last full block with T_{m-1} and the
+            // stolen block with T_m; decryption undoes them in reverse order
+            crypt_one(Enc, in_full, stolen, Enc ? t_prev : t_last);
+            memcpy(out_full + 16, stolen, tail);
+            memcpy(last + tail, stolen + tail, 16 - tail);
+            crypt_one(Enc, last, out_full, Enc ? t_last : t_prev);
+        }
+    }
+
+    template <bool Enc>
+    bool crypt(uint64_t first_sector, size_t sector_size, const uint8_t* in, uint8_t* out, size_t len,
+        SM4_WorkerPool& pool) {
+        if (len == 0) return true;
+        if (sector_size < 16 || (len % sector_size != 0 && len % sector_size < 16)) return false;
+
+        const size_t nsectors = (len + sector_size - 1) / sector_size;
+        size_t per_job = MIN_JOB_BYTES / sector_size;
+        if (per_job == 0) per_job = 1;
+        const size_t njobs = (nsectors + per_job - 1) / per_job;
+
+        pool.run(njobs, [&](size_t job) {
+            const size_t s0 = job * per_job;
+            const size_t s1 = s0 + per_job < nsectors ? s0 + per_job : nsectors;
+            uint8_t tweaks[BATCH_BLOCKS * 16];
+            for (size_t s = s0; s < s1; s += BATCH_BLOCKS) {
+                const size_t count = s1 - s < BATCH_BLOCKS ? s1 - s : BATCH_BLOCKS;
+                sector_tweaks(first_sector + s, count, tweaks);
+                for (size_t i = 0; i < count; ++i) {
+                    const size_t off = (s + i) * sector_size;
+                    const size_t n = len - off < sector_size ? len - off : sector_size;
+                    crypt_sector<Enc>(tweaks + i * 16, in + off, out + off, n);
+                }
+            }
+        });
+        return true;
+    }
+};
+
+
+#ifndef SM4_XTS_NO_MAIN
+int main() {
+    uint8_t key1[16], key2[16];
+    for (int i = 0; i < 16; ++i) {
+        key1[i] = (uint8_t)i;
+        key2[i] = (uint8_t)(0xF0 + i);
+    }
+    SM4_XTS xts;
+    xts.set_key(key1, key2);
+
+    // The threaded request path must match per-sector processing, including
+    // the ciphertext-stealing tail of a short last sector.
+    bool ok = true;
+    const size_t sizes[] = { 16, 17, 31, 512, 4096, 4096 * 64 + 17 };
+    for (size_t len : sizes) {
+        const size_t sector_size = len < 4096 ? len : 4096;
+        std::vector<uint8_t> plain(len), cipher(len), ref(len), back(len);
+        for (size_t i = 0; i < len; ++i) plain[i] = (uint8_t)(i * 29 + 1);
+
+        ok &= xts.encrypt(7, sector_size, plain.data(), cipher.data(), len);
+        for (size_t off = 0, s = 7; off < len; off += sector_size, ++s) {
+            size_t n = len - off < sector_size ? len - off : sector_size;
+            ok &= xts.encrypt_sector(s, plain.data() + off, ref.data() + off, n);
+        }
+        ok &= cipher == ref;
+        ok &= xts.decrypt(7, sector_size, cipher.data(), back.data(), len);
+        ok &= back == plain;
+
+        // in place
+        ok &= xts.encrypt(7, sector_size, back.data(), back.data(), len);
+        ok &= back == cipher;
+    }
+
+    // Known answers from a separate textbook IEEE 1619 implementation
+    // (section 5.3, SM4-ECB from the Python cryptography package): sector
+    // 0x0123456789, a 48-byte sector, and 53 bytes where the last 5 steal
+    // from the third block.
+    {
+        static const uint8_t kat48[48] = {
+            0x0c,0x47,0x1c,0x2d,0xc5,0x32,0x4a,0x07,0xe7,0xe0,0x04,0xde,0x53,0xb6,0xe1,0xbb,
+            0xc3,0x68,0xd3,0xbb,0xfe,0xc3,0x86,0xcf,0xbb,0xec,0x48,0xe9,0xd7,0xbe,0x43,0xe7,
+            0x34,0x78,0x31,0xfc,0xc7,0x39,0x2c,0x71,0xe3,0x87,0x37,0xf5,0x81,0x11,0xe9,0x3e };
+        static const uint8_t kat53[53] = {
+            0x0c,0x47,0x1c,0x2d,0xc5,0x32,0x4a,0x07,0xe7,0xe0,0x04,0xde,0x53,0xb6,0xe1,0xbb,
+            0xc3,0x68,0xd3,0xbb,0xfe,0xc3,0x86,0xcf,0xbb,0xec,0x48,0xe9,0xd7,0xbe,0x43,0xe7,
+            0x7e,0xe1,0x9a,0x2a,0xb8,0x7b,0x70,0xe4,0x5e,0x65,0xbd,0xda,0x66,0xeb,0x9c,0x3d,
+            0x34,0x78,0x31,0xfc,0xc7 };
+        uint8_t plain[53], cipher[53], back[53];
+        for (size_t i = 0; i < sizeof(plain); ++i) plain[i] = (uint8_t)(i * 29 + 1);
+        ok &= xts.encrypt_sector(0x0123456789, plain, cipher, 48) && memcmp(cipher, kat48, 48) == 0;
+        ok &= xts.encrypt(0x0123456789, 53, plain, cipher, 53) && memcmp(cipher, kat53, 53) == 0;
+        ok &= xts.decrypt_sector(0x0123456789, cipher, back, 53) && memcmp(back, plain, 53) == 0;
+    }
+    std::cout << "SM4-XTS self-check: " << (ok ? "OK" : "FAIL") << std::endl;
+
+    std::vector<uint8_t> buf(64 << 20), buf_out(buf.size());
+    auto start = std::chrono::high_resolution_clock::now();
+    xts.encrypt(0, 4096, buf.data(), buf_out.data(), buf.size());
+    auto end = std::chrono::high_resolution_clock::now();
+    double ms = std::chrono::duration<double, std::milli>(end - start).count();
+    std::cout << "SM4-XTS (" << SM4_Dispatch::backend_name(SM4_Dispatch::selected()) << ", "
+        << SM4_WorkerPool::shared().size() << " threads, 64 MB, 4 KB sectors): "
+        << ms << " ms, " << buf.size() / ms / 1e6 << " GB/s" << std::endl;
+    return ok ? 0 : 1;
+}
+#endif
@@ -0,0 +1,252 @@
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <unordered_map>
+#define SM4_BENCH_NO_MAIN
+#include "1b.cpp"
+
+// Multi-session SM4 for gateways with many live keys. A session only keeps
+// its 16-byte key; expanded schedules (ROUNDS words, 128 bytes) live in a
+// fixed slab of cache slots managed as an LRU, so memory is bounded no
+// matter how many sessions exist. The S-box tables are the shared read-only
+// ones of the backends.
+//
+// encrypt_blocks() takes one session id per block. Blocks are resolved to
+// slab offsets 16 at a time and go through the per-lane-key kernels of the
+// selected backend, so small packets of unrelated sessions still fill the
+// SIMD lanes. Not thread-safe: use one engine per thread.
+
+class SM4_MultiSession {
+public:
+    static const size_t CHUNK_BLOCKS = 16;
+
+    // cache_slots is raised to CHUNK_BLOCKS so one chunk never evicts itself.
+    explicit SM4_MultiSession(size_t cache_slots = 4096)
+        : slab((cache_slots < CHUNK_BLOCKS ? CHUNK_BLOCKS : cache_slots) * ROUNDS),
+        slots(cache_slots < CHUNK_BLOCKS ? CHUNK_BLOCKS : cache_slots),
+        lru_head(-1), lru_tail(-1), used(0), hit_count(0), miss_count(0) {
+    }
+
+    // Adds a session or rekeys an existing one.
+    void set_key(uint64_t session, const uint8_t key[16]) {
+        Session& s = sessions[session];
+        memcpy(s.key, key, 16);
+        if (s.slot >= 0) SM4_TTable::expand_key(key, &slab[s.slot * ROUNDS]);
+    }
+
+    void remove(uint64_t session) {
+        auto it = sessions.find(session);
+        if (it == sessions.end()) return;
+        if (it->second.slot >= 0) release(it->second.slot);
+        memset(it->second.key, 0, 16);
+        sessions.erase(it);
+    }
+
+    // Block b is processed under the key of sessions[b]. Returns false if a
+    // session is unknown; blocks before the failing chunk are already done.
+    bool encrypt_blocks(const uint64_t* ids, const uint8_t* in, uint8_t* out, size_t nblocks) {
+        return crypt<true>(ids, in, out, nblocks);
+    }
+
+    bool decrypt_blocks(const uint64_t* ids, const uint8_t* in, uint8_t* out, size_t nblocks) {
+        return crypt<false>(ids, in, out, nblocks);
+    }
+
+    size_t session_count() const { return sessions.size(); }
+    size_t cache_slots() const { return slots.size(); }
+    uint64_t hits() const { return hit_count; }
+    uint64_t misses() const { return miss_count; }
+
+private:
+    struct Session {
+        uint8_t key[16];
+        int32_t slot = -1;
+    };
+
+    // Cache slot i owns slab[i * ROUNDS .. +ROUNDS); prev/next link the LRU
+    // list, most recently used at the head.
+    struct Slot {
+        uint64_t session = 0;
+        bool live = false;
+        int32_t prev = -1;
+        int32_t next = -1;
+    };
+
+    SM4_Dispatch cipher;
+    std::unordered_map<uint64_t, Session> sessions;
+    std::vector<uint32_t> slab;
+    std::vector<Slot> slots;
+    int32_t lru_head, lru_tail;
+    size_t used;
+    uint64_t hit_count, miss_count;
+
+    // misses of the current chunk, expanded together by expand_pending()
+    uint8_t pending_keys[CHUNK_BLOCKS * 16];
+    int32_t pending_slots[CHUNK_BLOCKS];
+    size_t npending = 0;
+
+    void unlink(int32_t i) {
+        Slot& s = slots[i];
+        if (s.prev >= 0) slots[s.prev].next = s.next; else lru_head = s.next;
+        if (s.next >= 0) slots[s.next].prev = s.prev; else lru_tail = s.prev;
+        s.prev = s.next = -1;
+    }
+
+    void push_front(int32_t i) {
+        slots[i].prev = -1;
+        slots[i].next = lru_head;
+        if (lru_head >= 0) slots[lru_head].prev = i; else lru_tail = i;
+        lru_head = i;
+    }
+
+    void push_back(int32_t i) {
+        slots[i].next = -1;
+        slots[i].prev = lru_tail;
+        if (lru_tail >= 0) slots[lru_tail].next = i; else lru_head = i;
+        lru_tail = i;
+    }
+
+    // A freed slot goes to the tail so it is the next one reused.
+    void release(int32_t i) {
+        slots[i].live = false;
+        memset(&slab[i * ROUNDS], 0, ROUNDS * sizeof(uint32_t));
+        unlink(i);
+        push_back(i);
+    }
+
+    int32_t take_slot() {
+        if (used < slots.size()) return (int32_t)used++;
+        int32_t victim = lru_tail;
+        if (slots[victim].live) sessions[slots[victim].session].slot = -1;
+        unlink(victim);
+        return victim;
+    }
+
+    // Slab offset of the session's schedule; on a miss the slot is claimed
+    // and queued for expansion. -1 if the session does not exist.
+    int64_t lookup(uint64_t id) {
+        auto it = sessions.find(id);
+        if (it == sessions.end()) return -1;
+        Session& s = it->second;
+        if (s.slot >= 0) {
+            ++hit_count;
+            if (lru_head != s.slot) {
+                unlink(s.slot);
+                push_front(s.slot);
+            }
+        } else {
+            ++miss_count;
+            s.slot = take_slot();
+            slots[s.slot].session = id;
+            slots[s.slot].live = true;
+            memcpy(pending_keys + npending * 16, s.key, 16);
+            pending_slots[npending++] = s.slot;
+            push_front(s.slot);
+        }
+        return (int64_t)s.slot * ROUNDS;
+    }
+
+    // Rekey bursts miss many sessions at once, so a chunk's misses go through
+    // the lane-sliced batch key schedule together.
+    void expand_pending() {
+        if (npending == 0) return;
+        uint32_t rk[CHUNK_BLOCKS * ROUNDS];
+        sm4_expand_keys(pending_keys, npending, rk);
+        for (size_t i = 0; i < npending; ++i) {
+            memcpy(&slab[pending_slots[i] * ROUNDS], rk + i * ROUNDS, ROUNDS * sizeof(uint32_t));
+        }
+        npending = 0;
+    }
+
+    template <bool Enc>
+    bool crypt(const uint64_t* ids, const uint8_t* in, uint8_t* out, size_t nblocks) {
+        uint32_t off[CHUNK_BLOCKS];
+        for (size_t done = 0; done < nblocks; done += CHUNK_BLOCKS) {
+            const size_t n = nblocks - done < CHUNK_BLOCKS ? nblocks - done : CHUNK_BLOCKS;
+            for (size_t b = 0; b < n; ++b) {
+                int64_t o = lookup(ids[done + b]);
+                if (o < 0) {
+                    expand_pending();
+                    return false;
+                }
+                off[b] = (uint32_t)o;
+            }
+            expand_pending();
+            if (Enc) cipher.encrypt_blocks_multikey(slab.data(), off, in + done * 16, out + done * 16, n);
+            else cipher.decrypt_blocks_multikey(slab.data(), off, in + done * 16, out + done * 16, n);
+        }
+        return true;
+    }
+};
+
+
+#ifndef SM4_MULTI_NO_MAIN
+int main() {
+    const size_t NSESSIONS = 20000;
+    const size_t NBLOCKS = 1 << 18;
+    std::mt19937_64 rng(1);
+
+    SM4_MultiSession engine(4096);
+    std::vector<std::array<uint8_t, 16>> keys(NSESSIONS);
+    for (size_t s = 0; s < NSESSIONS; ++s) {
+        for (auto& k : keys[s]) k = (uint8_t)rng();
+        engine.set_key(s, keys[s].data());
+    }
+
+    // packets of 1-4 blocks from random sessions, interleaved block by block
+    std::vector<uint64_t> ids(NBLOCKS);
+    for (size_t b = 0; b < NBLOCKS;) {
+        uint64_t s = rng() % NSESSIONS;
+        for (size_t n = 1 + rng() % 4; n > 0 && b < NBLOCKS; --n) ids[b++] = s;
+    }
+    std::vector<uint8_t> plain(NBLOCKS * 16), cipher(plain.size()), back(plain.size());
+    for (auto& x : plain) x = (uint8_t)rng();
+
+    bool ok = engine.encrypt_blocks(ids.data(), plain.data(), cipher.data(), NBLOCKS);
+    SM4_TTable ref;
+    uint8_t expect[16];
+    for (size_t b = 0; b < NBLOCKS && ok; b += 97) {
+        ref.set_key(keys[ids[b]].data());
+        ref.encrypt(&plain[b * 16], expect);
+        ok = memcmp(expect, &cipher[b * 16], 16) == 0;
+    }
+    ok = ok && engine.decrypt_blocks(ids.data(), cipher.data(), back.data(), NBLOCKS) && back == plain;
+    uint64_t unknown = NSESSIONS + 1;
+    ok = ok && !engine.encrypt_blocks(&unknown, plain.data(), back.data(), 1);
+    std::cout << "SM4 multi-session self-check: " << (ok ? "OK" : "FAIL") << std::endl;
+
+    std::cout << "sessions: " << engine.session_count() << ", cached schedules: " << engine.cache_slots()
+        << " (" << engine.cache_slots() * ROUNDS * 4 / 1024 << " KB)" << std::endl;
+
+    // Baseline: rekey a single context for every packet.
+    SM4_Dispatch single;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t b = 0; b < NBLOCKS;) {
+        size_t n = 1;
+        while (b + n < NBLOCKS && ids[b + n] == ids[b]) ++n;
+        single.set_key(keys[ids[b]].data());
+        single.encrypt_blocks(&plain[b * 16], &cipher[b * 16], n);
+        b += n;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    std::cout << "Per-packet set_key + encrypt_blocks (" << NBLOCKS << " blocks): "
+        << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << " ms" << std::endl;
+
+    // Working set that fits the cache: 2000 hot sessions.
+    for (size_t b = 0; b < NBLOCKS; ++b) ids[b] %= 2000;
+    engine.encrypt_blocks(ids.data(), plain.data(), cipher.data(), NBLOCKS);
+    uint64_t h0 = engine.hits(), m0 = engine.misses();
+    start = std::chrono::high_resolution_clock::now();
+    engine.encrypt_blocks(ids.data(), plain.data(), cipher.data(), NBLOCKS);
+    end = std::chrono::high_resolution_clock::now();
+    std::cout << "Multi-session " << SM4_Dispatch::backend_name(SM4_Dispatch::selected())
+        << " (" << NBLOCKS << " blocks, 2000 hot sessions): "
+        << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << " ms, hit rate "
+        << std::fixed << std::setprecision(1)
+        << 100.0 * (engine.hits() - h0) / (engine.hits() - h0 + engine.misses() - m0) << "%" << std::endl;
+    return ok ? 0 : 1;
+}
+#endif
@@ -0,0 +1,447 @@
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <vector>
+#include <chrono>
+#include <memory>
+#define SM4_BENCH_NO_MAIN
+#include "1b.cpp"
+#include "4.a.4.cpp"
+
+// Asynchronous SM4/SM3 request queue, the software version of an offload
+// engine. Any number of threads submit jobs into a bounded lock-free MPSC
+// ring; one dispatcher thread drains it and groups the jobs into batches
+// that fill the SIMD lanes: SM4 blocks of unrelated callers (each with its
+// own key) go through the per-lane-key kernels, SM3 messages are hashed a
+// lane group at a time. A batch is released when it is full or when its
+// oldest job has waited max_delay. Callers poll() or wait() per job.
+
+struct SM_Job {
+    enum Op {
+        SM4_ENCRYPT,
+        SM4_DECRYPT,
+        SM3_HASH
+    };
+
+    Op op = SM3_HASH;
+    uint8_t key[16] = {};   // SM4 only
+    const uint8_t* in = nullptr;
+    uint8_t* out = nullptr; // SM4: len bytes, SM3: 32-byte digest
+    size_t len = 0;         // SM4: a multiple of 16
+
+    // owned by the queue while the job is in flight
+    std::atomic<bool> done{ false };
+    std::chrono::steady_clock::time_point submitted;
+};
+
+// Bounded multi-producer / single-consumer ring of pointers. Each cell
+// carries a sequence number telling whose turn it is (D. Vyukov's bounded
+// queue), so producers only contend on the tail CAS.
+template <class T>
+class SM_MpscRing {
+public:
+    explicit SM_MpscRing(size_t capacity) {
+        size_t n = 2;
+        while (n < capacity) n <<= 1;
+        mask = n - 1;
+        cells.reset(new Cell[n]);
+        for (size_t i = 0; i < n; ++i) cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    // Returns false if the ring is full.
+    bool push(T v) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& c = cells[pos & mask];
+            const intptr_t dif = (intptr_t)c.seq.load(std::memory_order_acquire) - (intptr_t)pos;
+            if (dif == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    c.value = v;
+                    c.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Consumer side only.
+    bool pop(T& v) {
+        Cell& c = cells[head & mask];
+        if ((intptr_t)c.seq.load(std::memory_order_acquire) - (intptr_t)(head + 1) < 0) return false;
+        v = c.value;
+        c.seq.store(head + mask + 1, std::memory_order_release);
+        ++head;
+        return true;
+    }
+
+    bool empty() const {
+        return (intptr_t)cells[head & mask].seq.load(std::memory_order_acquire) - (intptr_t)(head + 1) < 0;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> tail{ 0 };
+    alignas(64) size_t head = 0;
+};
+
+class SM_AsyncQueue {
+public:
+    static const size_t SM3_LANES = SM3_MB_LANES;
+    static const size_t STAGE_BLOCKS = 256;
+
+    explicit SM_AsyncQueue(size_t capacity = 4096,
+        std::chrono::microseconds max_delay = std::chrono::microseconds(20))
+        : ring(capacity), delay(max_delay), sm4_lanes(lanes_of(SM4_Dispatch::selected())) {
+        worker = std::thread([this] { dispatch_loop(); });
+    }
+
+    // Jobs still queued are completed before the dispatcher exits.
+    ~SM_AsyncQueue() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+
+    SM_AsyncQueue(const SM_AsyncQueue&) = delete;
+    SM_AsyncQueue& operator=(const SM_AsyncQueue&) = delete;
+
+    // The job must stay alive and untouched until it is done. Blocks (by
+    // yielding) while the ring is full.
+    void submit(SM_Job* job) {
+        job->done.store(false, std::memory_order_relaxed);
+        job->submitted = std::chrono::steady_clock::now();
+        while (!ring.push(job)) std::this_thread::yield();
+        // pairs with the fence in dispatch_loop() so a parked dispatcher
+        // always sees either the job or our wakeup
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(mtx);
+            wake.notify_one();
+        }
+    }
+
+    static bool poll(const SM_Job* job) {
+        return job->done.load(std::memory_order_acquire);
+    }
+
+    static void wait(const SM_Job* job) {
+        for (int spins = 0; !poll(job); ++spins) {
+            if (spins < spin_limit()) sm_pause();
+            else std::this_thread::yield();
+        }
+    }
+
+    size_t lanes() const { return sm4_lanes; }
+    uint64_t sm4_batches() const { return sm4_batch_count.load(); }
+    uint64_t sm4_blocks() const { return sm4_block_count.load(); }
+    uint64_t sm3_batches() const { return sm3_batch_count.load(); }
+    uint64_t sm3_jobs() const { return sm3_job_count.load(); }
+    // Batches released by the deadline rather than by filling up.
+    uint64_t deadline_flushes() const { return deadline_count.load(); }
+
+private:
+    SM_MpscRing<SM_Job*> ring;
+    std::chrono::microseconds delay;
+    size_t sm4_lanes;
+    SM4_Dispatch cipher;
+
+    std::thread worker;
+    std::mutex mtx;
+    std::condition_variable wake;
+    std::atomic<bool> sleeping{ false };
+    std::atomic<bool> stopping{ false };
+
+    // dispatcher state
+    std::vector<SM_Job*> sm4_pending, sm3_pending;
+    size_t sm4_pending_blocks = 0;
+    std::vector<uint8_t> keys;
+    std::vector<uint32_t> slab;
+
+    std::atomic<uint64_t> sm4_batch_count{ 0 }, sm4_block_count{ 0 };
+    std::atomic<uint64_t> sm3_batch_count{ 0 }, sm3_job_count{ 0 };
+    std::atomic<uint64_t> deadline_count{ 0 };
+
+    // Blocks of one direction gathered from many jobs for one kernel call.
+    struct Stage {
+        alignas(64) uint8_t buf[STAGE_BLOCKS * 16];
+        uint32_t off[STAGE_BLOCKS];
+        uint8_t* dst[STAGE_BLOCKS];
+        size_t n = 0;
+    };
+
+    static void sm_pause() {
+#ifdef SM4_HAVE_X86
+        _mm_pause();
+#endif
+    }
+
+    // Spinning only pays off when the other side runs on another core; on a
+    // single CPU every spin delays the thread we are waiting for.
+    static int spin_limit() {
+        static const int limit = std::thread::hardware_concurrency() > 1 ? 4096 : 0;
+        return limit;
+    }
+
+    static void backoff() {
+        if (spin_limit() > 0) sm_pause();
+        else std::this_thread::yield();
+    }
+
+    static size_t lanes_of(SM4_Dispatch::Backend b) {
+        switch (b) {
+        case SM4_Dispatch::BACKEND_GFNI_AVX512: return 16;
+        case SM4_Dispatch::BACKEND_AESNI_AVX2: return 8;
+        case SM4_Dispatch::BACKEND_AESNI: return 4;
+        default: return 1;
+        }
+    }
+
+    void flush(Stage& s, bool dec) {
+        if (s.n == 0) return;
+        if (dec) cipher.decrypt_blocks_multikey(slab.data(), s.off, s.buf, s.buf, s.n);
+        else cipher.encrypt_blocks_multikey(slab.data(), s.off, s.buf, s.buf, s.n);
+        for (size_t b = 0; b < s.n; ++b) {
+            memcpy(s.dst[b], s.buf + b * 16, 16);
+        }
+        s.n = 0;
+    }
+
+    void run_sm4() {
+        const size_t n = sm4_pending.size();
+        keys.resize(n * 16);
+        slab.resize(n * ROUNDS);
+        for (size_t i = 0; i < n; ++i) {
+            memcpy(&keys[i * 16], sm4_pending[i]->key, 16);
+        }
+        sm4_expand_keys(keys.data(), n, slab.data());
+
+        Stage stage[2];
+        for (size_t i = 0; i < n; ++i) {
+            SM_Job* job = sm4_pending[i];
+            const bool dec = job->op == SM_Job::SM4_DECRYPT;
+            Stage& s = stage[dec];
+            for (size_t b = 0; b < job->len / 16; ++b) {
+                memcpy(s.buf + s.n * 16, job->in + b * 16, 16);
+                s.off[s.n] = (uint32_t)(i * ROUNDS);
+                s.dst[s.n] = job->out + b * 16;
+                if (++s.n == STAGE_BLOCKS) flush(s, dec);
+            }
+        }
+        flush(stage[0], false);
+        flush(stage[1], true);
+
+        for (SM_Job* job : sm4_pending) job->done.store(true, std::memory_order_release);
+        sm4_batch_count.fetch_add(1, std::memory_order_relaxed);
+        sm4_block_count.fetch_add(sm4_pending_blocks, std::memory_order_relaxed);
+        sm4_pending.clear();
+        sm4_pending_blocks = 0;
+    }
+
+    // Multi-buffer SM3: every message of the batch takes its own lane.
+    void run_sm3() {
+        const size_t n = sm3_pending.size();
+        const uint8_t* msgs[SM3_LANES];
+        size_t lens[SM3_LANES];
+        uint8_t digests[SM3_LANES * 32];
+        for (size_t i = 0; i < n; ++i) {
+            msgs[i] = sm3_pending[i]->in;
+            lens[i] = sm3_pending[i]->len;
+        }
+        sm3_hash_many(msgs, lens, digests, n);
+        for (size_t i = 0; i < n; ++i) {
+            memcpy(sm3_pending[i]->out, digests + 32 * i, 32);
+            sm3_pending[i]->done.store(true, std::memory_order_release);
+        }
+        sm3_batch_count.fetch_add(1, std::memory_order_relaxed);
+        sm3_job_count.fetch_add(sm3_pending.size(), std::memory_order_relaxed);
+        sm3_pending.clear();
+    }
+
+    bool expired(const std::vector<SM_Job*>& pending, std::chrono::steady_clock::time_point now) const {
+        return !pending.empty() && now - pending.front()->submitted >= delay;
+    }
+
+    void dispatch_loop() {
+        int idle = 0;
+        for (;;) {
+            bool got = false;
+            SM_Job* job;
+            while (ring.pop(job)) {
+                got = true;
+                if (job->op == SM_Job::SM3_HASH) {
+                    sm3_pending.push_back(job);
+                    if (sm3_pending.size() >= SM3_LANES) run_sm3();
+                } else {
+                    sm4_pending.push_back(job);
+                    sm4_pending_blocks += job->len / 16;
+                    if (sm4_pending_blocks >= STAGE_BLOCKS) run_sm4();
+                }
+            }
+
+            const auto now = std::chrono::steady_clock::now();
+            if (sm4_pending_blocks >= sm4_lanes) {
+                run_sm4();
+            } else if (expired(sm4_pending, now)) {
+                deadline_count.fetch_add(1, std::memory_order_relaxed);
+                run_sm4();
+            }
+            if (expired(sm3_pending, now)) {
+                deadline_count.fetch_add(1, std::memory_order_relaxed);
+                run_sm3();
+            }
+
+            if (got || !sm4_pending.empty() || !sm3_pending.empty()) {
+                idle = 0;
+                backoff();
+                continue;
+            }
+
+            // spin for a while before parking, producers tend to come in bursts
+            if (++idle < 4 * spin_limit()) {
+                if (stopping.load() && ring.empty()) return;
+                sm_pause();
+                continue;
+            }
+            idle = 0;
+            std::unique_lock<std::mutex> lock(mtx);
+            sleeping.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            wake.wait(lock, [this] { return stopping || !ring.empty(); });
+            sleeping.store(false, std::memory_order_relaxed);
+            if (stopping && ring.empty()) return;
+        }
+    }
+};
+
+
+#ifndef SM_ASYNC_NO_MAIN
+int main() {
+    const int NTHREADS = 4;
+    const int PER_THREAD = 100000;
+    const int WINDOW = 64;
+
+    // Each producer owns a key; odd jobs encrypt one block, even jobs hash a
+    // 48-byte record, mixed the way a request handler would issue them.
+    auto make_input = [](int t, int i, uint8_t* buf, size_t n) {
+        for (size_t k = 0; k < n; ++k) buf[k] = (uint8_t)(t * 31 + i * 7 + k);
+    };
+
+    bool ok = true;
+    std::mutex ok_mtx;
+    auto start = std::chrono::steady_clock::now();
+    std::unique_ptr<SM_AsyncQueue> queue(new SM_AsyncQueue());
+    {
+        std::vector<std::thread> producers;
+        for (int t = 0; t < NTHREADS; ++t) {
+            producers.emplace_back([&, t] {
+                uint8_t key[16];
+                for (int k = 0; k < 16; ++k) key[k] = (uint8_t)(t + k);
+                std::vector<SM_Job> jobs(WINDOW);
+                std::vector<uint8_t> in(WINDOW * 48), out(WINDOW * 32);
+                bool mine = true;
+                for (int base = 0; base < PER_THREAD; base += WINDOW) {
+                    for (int w = 0; w < WINDOW; ++w) {
+                        SM_Job& j = jobs[w];
+                        const bool hash = (base + w) % 2 == 0;
+                        j.op = hash ? SM_Job::SM3_HASH : SM_Job::SM4_ENCRYPT;
+                        memcpy(j.key, key, 16);
+                        j.in = &in[w * 48];
+                        j.out = &out[w * 32];
+                        j.len = hash ? 48 : 16;
+                        make_input(t, base + w, &in[w * 48], j.len);
+                        queue->submit(&j);
+                    }
+                    for (int w = 0; w < WINDOW; ++w) SM_AsyncQueue::wait(&jobs[w]);
+
+                    // spot-check one window in 64 against direct calls
+                    if ((base / WINDOW) % 64 != 0) continue;
+                    SM4_TTable ref;
+                    ref.set_key(key);
+                    for (int w = 0; w < WINDOW; ++w) {
+                        uint8_t expect[32];
+                        if (jobs[w].op == SM_Job::SM3_HASH) {
+                            SM3_CTX ctx;
+                            sm3_init(&ctx);
+                            sm3_update(&ctx, jobs[w].in, jobs[w].len);
+                            sm3_final(&ctx, expect);
+                            mine &= memcmp(expect, jobs[w].out, 32) == 0;
+                        } else {
+                            ref.encrypt(jobs[w].in, expect);
+                            mine &= memcmp(expect, jobs[w].out, 16) == 0;
+                        }
+                    }
+                }
+                std::lock_guard<std::mutex> lock(ok_mtx);
+                ok &= mine;
+            });
+        }
+        for (auto& p : producers) p.join();
+    }
+    double queued_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    // Decryption through the queue must invert encryption.
+    {
+        uint8_t key[16] = { 9 }, plain[64], enc[64], back[64];
+        for (int i = 0; i < 64; ++i) plain[i] = (uint8_t)i;
+        SM_Job e, d;
+        e.op = SM_Job::SM4_ENCRYPT; memcpy(e.key, key, 16); e.in = plain; e.out = enc; e.len = 64;
+        queue->submit(&e);
+        SM_AsyncQueue::wait(&e);
+        d.op = SM_Job::SM4_DECRYPT; memcpy(d.key, key, 16); d.in = enc; d.out = back; d.len = 64;
+        queue->submit(&d);
+        SM_AsyncQueue::wait(&d);
+        ok &= memcmp(plain, back, 64) == 0;
+    }
+    std::cout << "SM4/SM3 async queue self-check: " << (ok ? "OK" : "FAIL") << std::endl;
+
+    // Baseline: every thread makes synchronous one-block / one-message calls.
+    start = std::chrono::steady_clock::now();
+    {
+        std::vector<std::thread> callers;
+        for (int t = 0; t < NTHREADS; ++t) {
+            callers.emplace_back([&, t] {
+                uint8_t key[16], in[48], out[32];
+                for (int k = 0; k < 16; ++k) key[k] = (uint8_t)(t + k);
+                for (int i = 0; i < PER_THREAD; ++i) {
+                    make_input(t, i, in, i % 2 == 0 ? 48 : 16);
+                    if (i % 2 == 0) {
+                        SM3_CTX ctx;
+                        sm3_init(&ctx);
+                        sm3_update(&ctx, in, 48);
+                        sm3_final(&ctx, out);
+                    } else {
+                        SM4_Dispatch c;
+                        c.set_key(key);
+                        c.encrypt(in, out);
+                    }
+                }
+            });
+        }
+        for (auto& c : callers) c.join();
+    }
+    double sync_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "Synchronous calls (" << NTHREADS << " threads, " << NTHREADS * PER_THREAD << " jobs): "
+        << sync_ms << " ms" << std::endl;
+    std::cout << "Async queue (" << SM4_Dispatch::backend_name(SM4_Dispatch::selected()) << ", "
+        << queue->lanes() << " lanes): " << queued_ms << " ms, "
+        << std::fixed << std::setprecision(1)
+        << (double)queue->sm4_blocks() / queue->sm4_batches() << " SM4 blocks/batch, "
+        << (double)queue->sm3_jobs() / queue->sm3_batches() << " SM3 messages/batch, "
+        << queue->deadline_flushes() << " deadline flushes" << std::endl;
+    return ok ? 0 : 1;
+}
+#endif
@@ -0,0 +1,190 @@
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <vector>
+#include <chrono>
+#define SM4_BENCH_NO_MAIN
+#include "1b.cpp"
+#define SM3_HMAC_NO_MAIN
+#include "4.a.7.cpp"
+
+// Single-pass SM4-CTR + HMAC-SM3 (encrypt-then-MAC) for bulk storage.
+// Instead of encrypting a whole buffer and then hashing it in a second pass,
+// update() encrypts one chunk that fits in L1 and feeds its ciphertext to SM3
+// right away, so the input is read from memory once and never has to be
+// held whole. This is about memory access, not speed: SM3 runs at roughly
+// 0.25 GB/s, far below memory bandwidth, so the benchmark below shows the
+// single pass level with two passes, within run-to-run noise. The tag is
+// HMAC-SM3(mac_key, iv || ciphertext). init/update/final stream over input
+// of any size; update() lengths need not be multiples of 16. The MAC is the
+// streaming HMAC-SM3 of 4.a.7.cpp on the 4.a.4.cpp hash.
+
+class SM4_CtrHmacSm3 {
+public:
+    // ciphertext of one chunk is still in L1 when SM3 reads it; 4 KB to 1 MB
+    // all measured the same, as SM3 is the bottleneck
+    static const size_t CHUNK_BYTES = 16 * 1024;
+
+    // encrypt = false authenticates the input (ciphertext) before decrypting
+    // it; check the tag with verify() instead of final().
+    void init(const uint8_t enc_key[16], const uint8_t* mac_key, size_t mac_key_len,
+        const uint8_t iv[16], bool encrypt = true) {
+        SM3_HmacKey hk;
+        sm3_hmac_key(&hk, mac_key, mac_key_len);
+        init(enc_key, &hk, iv, encrypt);
+        memset(&hk, 0, sizeof(hk));
+    }
+
+    // Same, with the pad states already computed by sm3_hmac_key() so many
+    // streams under one MAC key skip the two pad compressions.
+    void init(const uint8_t enc_key[16], const SM3_HmacKey* mac_key,
+        const uint8_t iv[16], bool encrypt = true) {
+        cipher.set_key(enc_key);
+        memcpy(ctr, iv, 16);
+        ks_used = 16;
+        enc = encrypt;
+        sm3_hmac_init(&hmac, mac_key);
+        sm3_hmac_update(&hmac, iv, 16);
+    }
+
+    void update(const uint8_t* in, uint8_t* out, size_t len) {
+        // leftover keystream of a block split by the previous call
+        if (ks_used < 16 && len > 0) {
+            size_t m = 16 - ks_used < len ? 16 - ks_used : len;
+            crypt_piece(in, out, m, ks + ks_used);
+            ks_used += m;
+            in += m; out += m; len -= m;
+        }
+        while (len >= 16) {
+            size_t n = len < CHUNK_BYTES ? len & ~(size_t)15 : CHUNK_BYTES;
+            if (!enc) sm3_hmac_update(&hmac, in, n);
+            sm4_ctr_crypt(cipher, ctr, in, out, n);
+            if (enc) sm3_hmac_update(&hmac, out, n);
+            in += n; out += n; len -= n;
+        }
+        if (len > 0) {
+            memset(ks, 0, 16);
+            sm4_ctr_crypt(cipher, ctr, ks, ks, 16);
+            crypt_piece(in, out, len, ks);
+            ks_used = len;
+        }
+    }
+
+    void final(uint8_t tag[32]) {
+        sm3_hmac_final(&hmac, tag);
+        memset(ks, 0, sizeof(ks));
+    }
+
+    // Decryption side. Plaintext has already been released by update(), so
+    // the caller must discard it if this returns false.
+    bool verify(const uint8_t tag[32]) {
+        uint8_t computed[32];
+        final(computed);
+        return sm3_hmac_equal(computed, tag);
+    }
+
+private:
+    SM4_Dispatch cipher;
+    SM3_HmacCtx hmac;
+    uint8_t ctr[16];
+    uint8_t ks[16];
+    size_t ks_used = 16;
+    bool enc = true;
+
+    void crypt_piece(const uint8_t* in, uint8_t* out, size_t n, const uint8_t* k) {
+        if (!enc) sm3_hmac_update(&hmac, in, n);
+        sm4_xor(out, in, k, n);
+        if (enc) sm3_hmac_update(&hmac, out, n);
+    }
+};
+
+
+#ifndef SM4_ETM_NO_MAIN
+int main() {
+    bool ok = true;
+
+    // HMAC-SM3 itself is checked against known answers in 4.a.7.cpp.
+    uint8_t enc_key[16], mac_key[32], iv[16];
+    for (int i = 0; i < 16; ++i) enc_key[i] = (uint8_t)(i * 3 + 1);
+    for (int i = 0; i < 32; ++i) mac_key[i] = (uint8_t)(0x80 + i);
+    for (int i = 0; i < 16; ++i) iv[i] = (uint8_t)(0xF0 ^ i);
+
+    // Streaming with odd update sizes must match encrypt-all-then-MAC.
+    {
+        std::vector<uint8_t> plain(100000), ref(plain.size()), out(plain.size()), back(plain.size());
+        for (size_t i = 0; i < plain.size(); ++i) plain[i] = (uint8_t)(i * 11 + 5);
+
+        SM4_Dispatch c;
+        c.set_key(enc_key);
+        uint8_t ctr[16], ref_tag[32], tag[32];
+        memcpy(ctr, iv, 16);
+        sm4_ctr_crypt(c, ctr, plain.data(), ref.data(), plain.size());
+        SM3_HmacKey hk;
+        SM3_HmacCtx h;
+        sm3_hmac_key(&hk, mac_key, sizeof(mac_key));
+        sm3_hmac_init(&h, &hk);
+        sm3_hmac_update(&h, iv, 16);
+        sm3_hmac_update(&h, ref.data(), ref.size());
+        sm3_hmac_final(&h, ref_tag);
+
+        SM4_CtrHmacSm3 etm;
+        etm.init(enc_key, mac_key, sizeof(mac_key), iv);
+        const size_t steps[] = { 1, 7, 16, 33, 5000, 16384, 20000, 3 };
+        for (size_t off = 0, k = 0; off < plain.size(); ++k) {
+            size_t n = steps[k % 8] < plain.size() - off ? steps[k % 8] : plain.size() - off;
+            etm.update(&plain[off], &out[off], n);
+            off += n;
+        }
+        etm.final(tag);
+        ok &= out == ref && memcmp(tag, ref_tag, 32) == 0;
+
+        etm.init(enc_key, &hk, iv, false);
+        etm.update(out.data(), back.data(), 12345);
+        etm.update(out.data() + 12345, back.data() + 12345, out.size() - 12345);
+        ok &= etm.verify(tag) && back == plain;
+
+        out[777] ^= 1;
+        etm.init(enc_key, mac_key, sizeof(mac_key), iv, false);
+        etm.update(out.data(), back.data(), out.size());
+        ok &= !etm.verify(tag);
+    }
+    std::cout << "SM4-CTR + HMAC-SM3 self-check: " << (ok ? "OK" : "FAIL") << std::endl;
+
+    // Buffers well beyond the last-level cache.
+    std::vector<uint8_t> buf(128 << 20), buf_out(buf.size());
+    for (size_t i = 0; i < buf.size(); i += 4096) buf[i] = (uint8_t)i;
+    uint8_t tag[32];
+
+    auto start = std::chrono::high_resolution_clock::now();
+    {
+        SM4_Dispatch c;
+        c.set_key(enc_key);
+        uint8_t ctr[16];
+        memcpy(ctr, iv, 16);
+        sm4_ctr_crypt(c, ctr, buf.data(), buf_out.data(), buf.size());
+        SM3_HmacKey hk;
+        SM3_HmacCtx h;
+        sm3_hmac_key(&hk, mac_key, sizeof(mac_key));
+        sm3_hmac_init(&h, &hk);
+        sm3_hmac_update(&h, iv, 16);
+        sm3_hmac_update(&h, buf_out.data(), buf_out.size());
+        sm3_hmac_final(&h, tag);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    double two_pass = std::chrono::duration<double, std::milli>(end - start).count();
+
+    start = std::chrono::high_resolution_clock::now();
+    SM4_CtrHmacSm3 etm;
+    etm.init(enc_key, mac_key, sizeof(mac_key), iv);
+    etm.update(buf.data(), buf_out.data(), buf.size());
+    etm.final(tag);
+    end = std::chrono::high_resolution_clock::now();
+    double stitched = std::chrono::duration<double, std::milli>(end - start).count();
+
+    std::cout << "SM4-CTR then HMAC-SM3, two passes (128 MB): " << two_pass << " ms, "
+        << buf.size() / two_pass / 1e6 << " GB/s" << std::endl;
+    std::cout << "SM4-CTR + HMAC-SM3 stitched (128 MB): " << stitched << " ms, "
+        << buf.size() / stitched / 1e6 << " GB/s" << std::endl;
+    return ok ? 0 : 1;
+}
+#endif
@@ -0,0 +1,310 @@
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <vector>
+#include <chrono>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <algorithm>
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
+#define SM4_BENCH_NO_MAIN
+#include "1b.cpp"
+#define SM4_GCM_NO_MAIN
+#include "1c.cpp"
+#define SM4_XTS_NO_MAIN
+#include "1d.cpp"
+
+// SM4 benchmark suite: every backend the host can run x every mode (ECB, CTR,
+// CBC, GCM, XTS) x message sizes 16 B .. 16 MB, plus CTR thread scaling.
+// GCM and XTS run on each SM4_Dispatch backend, the T-table one included.
+// Each point is calibrated to run for at least --min-ms, repeated, and the
+// best trial is kept; time is taken both with rdtsc (reference cycles, so
+// cycles/byte is comparable across runs on one host but not with turbo core
+// clocks) and steady_clock.
+//
+// Inputs are random, every output is folded into a checksum that is printed,
+// and a compiler barrier follows each call, so no work can be hoisted or
+// dropped. Data is hot in cache except where the size exceeds it.
+//
+// usage: 1j [--json <file>] [--min-ms <n>] [--max-bytes <n>] [--threads <n>]
+
+static inline uint64_t bench_ticks() {
+#ifdef __x86_64__
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Tells the compiler the buffer is read and may have changed.
+static inline void bench_clobber(const void* p) {
+    asm volatile("" : : "r"(p) : "memory");
+}
+
+enum BenchMode { MODE_ECB, MODE_CTR, MODE_CBC_ENC, MODE_CBC_DEC, MODE_GCM, MODE_XTS };
+
+static const char* bench_mode_name(BenchMode m) {
+    static const char* names[] = { "ecb", "ctr", "cbc_enc", "cbc_dec", "gcm", "xts" };
+    return names[m];
+}
+
+struct BenchResult {
+    std::string backend, mode;
+    size_t bytes;
+    unsigned threads;
+    double ticks_per_byte, ns_per_byte;
+
+    double gbps() const {
+        return ns_per_byte > 0 ? threads / ns_per_byte : 0;
+    }
+};
+
+// One backend exposed through the modes of 1b.cpp; op(mode, in, out, len).
+struct BenchBackend {
+    std::string name;
+    std::vector<BenchMode> modes;
+    std::function<void(BenchMode, const uint8_t*, uint8_t*, size_t)> op;
+};
+
+template <class Cipher>
+static BenchBackend bench_backend(const std::string& name, std::shared_ptr<Cipher> c) {
+    BenchBackend b;
+    b.name = name;
+    b.modes = { MODE_ECB, MODE_CTR, MODE_CBC_ENC, MODE_CBC_DEC };
+    b.op = [c](BenchMode mode, const uint8_t* in, uint8_t* out, size_t len) {
+        uint8_t iv[16] = { 0 };
+        switch (mode) {
+        case MODE_ECB: c->encrypt_blocks(in, out, len / 16); break;
+        case MODE_CTR: sm4_ctr_crypt(*c, iv, in, out, len); break;
+        case MODE_CBC_ENC: sm4_cbc_encrypt(*c, iv, in, out, len / 16); break;
+        default: sm4_cbc_decrypt(*c, iv, in, out, len / 16); break;
+        }
+    };
+    return b;
+}
+
+// GCM and XTS built on one SM4_Dispatch backend.
+static void bench_add_aead(BenchBackend& b, SM4_Dispatch::Backend backend, const uint8_t key[16]) {
+    auto gcm = std::make_shared<SM4_GCM>(backend);
+    gcm->set_key(key);
+    auto xts = std::make_shared<SM4_XTS>(backend);
+    xts->set_key(key, key);
+    auto block_modes = b.op;
+    b.modes.push_back(MODE_GCM);
+    b.modes.push_back(MODE_XTS);
+    b.op = [block_modes, gcm, xts](BenchMode mode, const uint8_t* in, uint8_t* out, size_t len) {
+        uint8_t iv[12] = { 0 }, tag[16];
+        if (mode == MODE_GCM) gcm->encrypt(iv, 12, nullptr, 0, in, out, len, tag);
+        else if (mode == MODE_XTS) xts->encrypt(0, len < 4096 ? len : 4096, in, out, len);
+        else block_modes(mode, in, out, len);
+    };
+}
+
+class SM4_BenchSuite {
+public:
+    double min_ms = 20;
+    size_t max_bytes = 16 << 20;
+    unsigned max_threads = std::thread::hardware_concurrency();
+
+    SM4_BenchSuite() {
+        uint8_t key[16];
+        std::mt19937 rng(2024);
+        for (auto& k : key) k = (uint8_t)rng();
+
+        auto t = std::make_shared<SM4_TTable>();
+        t->set_key(key);
+        backends.push_back(bench_backend("T-table", t));
+        bench_add_aead(backends.back(), SM4_Dispatch::BACKEND_TTABLE, key);
+        auto t1k = std::make_shared<SM4_TTable1K>();
+        t1k->set_key(key);
+        backends.push_back(bench_backend("T-table 1 KB", t1k));
+        for (int b = SM4_Dispatch::BACKEND_AESNI; b < SM4_Dispatch::BACKEND_COUNT; ++b) {
+            const auto backend = (SM4_Dispatch::Backend)b;
+            if (!SM4_Dispatch::available(backend)) continue;
+            auto d = std::make_shared<SM4_Dispatch>(backend);
+            d->set_key(key);
+            backends.push_back(bench_backend(SM4_Dispatch::backend_name(backend), d));
+            bench_add_aead(backends.back(), backend, key);
+        }
+    }
+
+    void run() {
+        std::vector<size_t> sizes;
+        for (size_t n = 16; n <= max_bytes; n *= 4) sizes.push_back(n);
+
+        in.resize(max_bytes);
+        out.resize(max_bytes);
+        std::mt19937_64 rng(7);
+        for (auto& x : in) x = (uint8_t)rng();
+
+        for (const BenchBackend& b : backends) {
+            for (BenchMode mode : b.modes) {
+                for (size_t n : sizes) {
+                    BenchResult r = measure(b, mode, n);
+                    print(r);
+                    results.push_back(r);
+                }
+            }
+        }
+
+        // CTR scaling: each thread encrypts its own 1 MB buffers
+        for (const BenchBackend& b : backends) {
+            if (b.modes[0] != MODE_ECB) continue;
+            for (unsigned t = 1; t <= max_threads; t = t < max_threads && t * 2 > max_threads ? max_threads : t * 2) {
+                BenchResult r = measure_threads(b, t);
+                print(r);
+                scaling.push_back(r);
+            }
+        }
+        std::cout << "checksum " << std::hex << checksum << std::dec << std::endl;
+    }
+
+    std::string json() const {
+        std::ostringstream o;
+        o << "{\n  \"host\": {\"selected_backend\": \"" << SM4_Dispatch::backend_name(SM4_Dispatch::selected())
+            << "\", \"hardware_threads\": " << std::thread::hardware_concurrency()
+            << ", \"rdtsc\": " << (bench_ticks() != 0 ? "true" : "false") << "},\n";
+        o << "  \"results\": [\n";
+        write_list(o, results);
+        o << "  ],\n  \"thread_scaling\": [\n";
+        write_list(o, scaling);
+        o << "  ],\n  \"checksum\": \"" << std::hex << checksum << std::dec << "\"\n}\n";
+        return o.str();
+    }
+
+private:
+    std::vector<BenchBackend> backends;
+    std::vector<BenchResult> results, scaling;
+    std::vector<uint8_t> in, out;
+    uint64_t checksum = 0;
+
+    void fold(const uint8_t* p, size_t len) {
+        bench_clobber(p);
+        uint64_t x;
+        memcpy(&x, p + len - 8, 8);
+        checksum = (checksum ^ x) * 0x100000001B3ull;
+    }
+
+    // Doubles the iteration count until one trial lasts min_ms, then keeps
+    // the best of three trials.
+    BenchResult measure(const BenchBackend& b, BenchMode mode, size_t n) {
+        b.op(mode, in.data(), out.data(), n);
+        size_t iters = 1;
+        for (;;) {
+            auto t0 = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < iters; ++i) {
+                b.op(mode, in.data(), out.data(), n);
+                bench_clobber(out.data());
+            }
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+            if (ms >= min_ms || iters >= ((size_t)1 << 30)) break;
+            iters *= ms > 0 ? std::min<size_t>(8, std::max<size_t>(2, (size_t)(min_ms / ms))) : 8;
+        }
+
+        BenchResult r{ b.name, bench_mode_name(mode), n, 1, 1e300, 1e300 };
+        for (int trial = 0; trial < 3; ++trial) {
+            uint64_t c0 = bench_ticks();
+            auto t0 = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < iters; ++i) {
+                b.op(mode, in.data(), out.data(), n);
+                bench_clobber(out.data());
+            }
+            uint64_t c1 = bench_ticks();
+            double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+            r.ticks_per_byte = std::min(r.ticks_per_byte, (double)(c1 - c0) / ((double)iters * n));
+            r.ns_per_byte = std::min(r.ns_per_byte, ns / ((double)iters * n));
+            fold(out.data(), n);
+        }
+        return r;
+    }
+
+    BenchResult measure_threads(const BenchBackend& b, unsigned nthreads) {
+        const size_t n = 1 << 20;
+        // about min_ms per thread at 1 GB/s
+        const size_t iters = std::max<size_t>(1, (size_t)(min_ms * 1e6 / n));
+        std::vector<std::vector<uint8_t>> bufs(nthreads * 2, std::vector<uint8_t>(n));
+        for (auto& v : bufs) memcpy(v.data(), in.data(), std::min(n, in.size()));
+
+        std::atomic<unsigned> ready{ 0 };
+        std::atomic<bool> go{ false };
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t < nthreads; ++t) {
+            threads.emplace_back([&, t] {
+                ++ready;
+                while (!go.load()) std::this_thread::yield();
+                for (size_t i = 0; i < iters; ++i) {
+                    b.op(MODE_CTR, bufs[2 * t].data(), bufs[2 * t + 1].data(), n);
+                    bench_clobber(bufs[2 * t + 1].data());
+                }
+            });
+        }
+        while (ready.load() < nthreads) std::this_thread::yield();
+        uint64_t c0 = bench_ticks();
+        auto t0 = std::chrono::steady_clock::now();
+        go.store(true);
+        for (auto& th : threads) th.join();
+        uint64_t c1 = bench_ticks();
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+        for (unsigned t = 0; t < nthreads; ++t) fold(bufs[2 * t + 1].data(), n);
+
+        // per-byte figures are wall time over the bytes of one thread, so
+        // gbps() = threads / ns_per_byte is the aggregate rate
+        const double bytes = (double)iters * n;
+        return BenchResult{ b.name, "ctr", n, nthreads, (double)(c1 - c0) / bytes, ns / bytes };
+    }
+
+    static void print(const BenchResult& r) {
+        std::cout << std::left << std::setw(22) << r.backend << std::setw(9) << r.mode
+            << std::right << std::setw(10) << r.bytes << " B  " << std::setw(3) << r.threads << " thr  "
+            << std::fixed << std::setprecision(2) << std::setw(8) << r.ticks_per_byte << " cyc/B  "
+            << std::setw(8) << r.gbps() << " GB/s" << std::endl;
+        std::cout.unsetf(std::ios::fixed);
+    }
+
+    static void write_list(std::ostringstream& o, const std::vector<BenchResult>& list) {
+        for (size_t i = 0; i < list.size(); ++i) {
+            const BenchResult& r = list[i];
+            o << "    {\"backend\": \"" << r.backend << "\", \"mode\": \"" << r.mode << "\", \"bytes\": " << r.bytes
+                << ", \"threads\": " << r.threads << ", \"cycles_per_byte\": " << r.ticks_per_byte
+                << ", \"ns_per_byte\": " << r.ns_per_byte << ", \"gbps\": " << r.gbps() << "}"
+                << (i + 1 < list.size() ? ",\n" : "\n");
+        }
+    }
+};
+
+
+#ifndef SM4_BENCH_SUITE_NO_MAIN
+int main(int argc, char* argv[]) {
+    SM4_BenchSuite suite;
+    const char* json_path = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        if (i + 1 < argc && a == "--json") json_path = argv[++i];
+        else if (i + 1 < argc && a == "--min-ms") suite.min_ms = atof(argv[++i]);
+        else if (i + 1 < argc && a == "--max-bytes") suite.max_bytes = std::max<size_t>(16, strtoull(argv[++i], nullptr, 10));
+        else if (i + 1 < argc && a == "--threads") suite.max_threads = std::max(1, atoi(argv[++i]));
+        else {
+            std::cerr << "usage: " << argv[0] << " [--json <file>] [--min-ms <n>] [--max-bytes <n>] [--threads <n>]"
+                << std::endl;
+            return 2;
+        }
+    }
+    if (suite.max_threads == 0) suite.max_threads = 1;
+
+    suite.run();
+    if (json_path) {
+        std::ofstream f(json_path);
+        f << suite.json();
+        if (!f) {
+            std::cerr << "cannot write " << json_path << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
+#endif
@@ -1,10 +1,18 @@
-
 #include <cstdint>
 #include <cstring>
 #include <cstdio>
 #include <cstdlib>
-#ifdef USE_AVX2
+#include <atomic>
+#include <vector>
+//  SIMD kernels carry per-function target attributes instead of global -m
+//  flags, so a generic build contains all of them and sm3_backend() picks
+//  one at run time.
+#if defined(__x86_64__) || defined(__i386__)
+    #define SM3_HAVE_X86 1
     #include <immintrin.h>
+    #define SM3_TARGET_SSSE3  __attribute__((target("ssse3")))
+    #define SM3_TARGET_AVX2   __attribute__((target("avx2")))
+    #define SM3_TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
 #endif
 
 #if defined(__GNUC__)
@@ -22,15 +30,16 @@ static inline uint32_t P1(uint32_t x){ return x ^ rotl32(x,15)^ rotl32(x,23); }
 #define FF16(a,b,c) (((a)&(b)) | ((a)&(c)) | ((b)&(c)))
 #define GG16(e,f,g) (((e)&(f)) | (~(e)&(g)))
 
+// TJROT32[j] = T_j <<< (j mod 32)
 static const uint32_t TJROT32[64]={
     0x79CC4519,0xF3988A32,0xE7311465,0xCE6228CB,0x9CC45197,0x3988A32F,0x7311465E,0xE6228CBC,
-    0xC4519799,0x88A32F33,0x11465E67,0x228CBCCE,0x4519799C,0x8A32F339,0x1465E673,0x28CBCCE6,
-    0xDE6E56C6,0xBCDCAD8D,0x79B95B1B,0xF372B637,0xE6E56C6E,0xCDCAD8DD,0x9B95B1BB,0x372B6377,
-    0x6E56C6EE,0xCDCACDD ,0xB95B1BB9,0x72B63773,0xE56C6EE6,0xCAD8DCCD,0x95B1BB9B,0x2B637737,
-    0x56C6EE6E,0xAD8DCCD ,0x5B1BB9B9,0xB6377373,0x6C6EE6E6,0xD8DCCDCD,0xB1BB9B9B,0x63773737,
-    0xC6EE6E6E,0x8DCCDCDC,0x1BB9B9B9,0x37737373,0x6EE6E6E6,0xDCCDCDCC,0xBB9B9B99,0x77373733,
-    0xEE6E6E66,0x0DCDCDCC,0xB9B9B998,0x73737331,0xE6E6E662,0x0CDCDCC ,0x09B9B99 ,0x0373731 ,
-    0x06E6E62 ,0x00DCDC  ,0x0B9B98  ,0x073731  ,0x0E6E62 ,0x00CDCC ,0x009B98 ,0x0031   };
+    0xCC451979,0x988A32F3,0x311465E7,0x6228CBCE,0xC451979C,0x88A32F39,0x11465E73,0x228CBCE6,
+    0x9D8A7A87,0x3B14F50F,0x7629EA1E,0xEC53D43C,0xD8A7A879,0xB14F50F3,0x629EA1E7,0xC53D43CE,
+    0x8A7A879D,0x14F50F3B,0x29EA1E76,0x53D43CEC,0xA7A879D8,0x4F50F3B1,0x9EA1E762,0x3D43CEC5,
+    0x7A879D8A,0xF50F3B14,0xEA1E7629,0xD43CEC53,0xA879D8A7,0x50F3B14F,0xA1E7629E,0x43CEC53D,
+    0x879D8A7A,0x0F3B14F5,0x1E7629EA,0x3CEC53D4,0x79D8A7A8,0xF3B14F50,0xE7629EA1,0xCEC53D43,
+    0x9D8A7A87,0x3B14F50F,0x7629EA1E,0xEC53D43C,0xD8A7A879,0xB14F50F3,0x629EA1E7,0xC53D43CE,
+    0x8A7A879D,0x14F50F3B,0x29EA1E76,0x53D43CEC,0xA7A879D8,0x4F50F3B1,0x9EA1E762,0x3D43CEC5 };
 
 // =============================================================================
 //  Context Structure
@@ -38,7 +47,7 @@ static const uint32_t TJROT32[64]={
 struct SM3_CTX{
     uint32_t state[8];            // hash state
     uint64_t bitlen;             // total length in bits
-    alignas(32) uint8_t buffer[64]; // partial block buffer (32-byte aligned for AVX2 loads)
+    alignas(32) uint8_t buffer[64]; // partial block buffer
 };
 static const uint32_t IV[8]={0x7380166F,0x4914B2B9,0x172442D7,0xDA8A0600,0xA96F30BC,0x163138AA,0xE38DEE4D,0xB0FB0E4E};
 
@@ -63,48 +72,168 @@ static void sm3_compress_scalar(uint32_t V[8], const uint8_t block[64]){
     uint32_t SS2=SS1^rotl32(A,12);\
     uint32_t TT1=(FF00(A,B,C)+D+SS2+Wp[i])&0xFFFFFFFFu;\
     uint32_t TT2=(GG00(E,F,G)+H+SS1+W[i]) &0xFFFFFFFFu;\
-    D=C; C=rotl32(B,9); B=A; A=TT1; H=G; G=rotl32(F,19); F=E; E=P0(TT2);} 
+    D=C; C=rotl32(B,9); B=A; A=TT1; H=G; G=rotl32(F,19); F=E; E=P0(TT2);}
 #define ROUND16(i) {\
     uint32_t SS1=rotl32((rotl32(A,12)+E+TJROT32[i])&0xFFFFFFFFu,7);\
     uint32_t SS2=SS1^rotl32(A,12);\
     uint32_t TT1=(FF16(A,B,C)+D+SS2+Wp[i])&0xFFFFFFFFu;\
     uint32_t TT2=(GG16(E,F,G)+H+SS1+W[i]) &0xFFFFFFFFu;\
-    D=C; C=rotl32(B,9); B=A; A=TT1; H=G; G=rotl32(F,19); F=E; E=P0(TT2);} 
+    D=C; C=rotl32(B,9); B=A; A=TT1; H=G; G=rotl32(F,19); F=E; E=P0(TT2);}
     ROUND00(0);  ROUND00(1);  ROUND00(2);  ROUND00(3);
     ROUND00(4);  ROUND00(5);  ROUND00(6);  ROUND00(7);
     ROUND00(8);  ROUND00(9);  ROUND00(10); ROUND00(11);
     ROUND00(12); ROUND00(13); ROUND00(14); ROUND00(15);
-    for(int j=16;j<64;++j){
-        if(j<32){ ROUND16(j); }
-        else { ROUND16(j); }
-    }
+    for(int j=16;j<64;++j){ ROUND16(j); }
 #undef ROUND00
 #undef ROUND16
     V[0]^=A; V[1]^=B; V[2]^=C; V[3]^=D; V[4]^=E; V[5]^=F; V[6]^=G; V[7]^=H;
 }
 
+// =============================================================================
+//  ── Unrolled Compression (4.a.2/4.a.3 style) ──
+// =============================================================================
+//  All 64 rounds written out; instead of shifting A..H every round the
+//  registers change roles, so a round only writes the four words it changes
+//  (B, D, F, H) and the pattern repeats every four rounds. W′ is formed on
+//  the fly from W.
+//  Wj and Wpj are W[j] and W′[j].
+#define SM3_RND(A,B,C,D,E,F,G,H,FF,GG,j,Wj,Wpj) {\
+    uint32_t A12=rotl32(A,12);\
+    uint32_t SS1=rotl32(A12+E+TJROT32[j],7);\
+    uint32_t SS2=SS1^A12;\
+    uint32_t TT1=FF(A,B,C)+D+SS2+(Wpj);\
+    uint32_t TT2=GG(E,F,G)+H+SS1+(Wj);\
+    B=rotl32(B,9); D=TT1; F=rotl32(F,19); H=P0(TT2);}
+#define SM3_RND4(FF,GG,j) \
+    SM3_RND(A,B,C,D,E,F,G,H,FF,GG,j,  W[j],  W[j]^W[(j)+4]) \
+    SM3_RND(D,A,B,C,H,E,F,G,FF,GG,(j)+1,W[(j)+1],W[(j)+1]^W[(j)+5]) \
+    SM3_RND(C,D,A,B,G,H,E,F,FF,GG,(j)+2,W[(j)+2],W[(j)+2]^W[(j)+6]) \
+    SM3_RND(B,C,D,A,F,G,H,E,FF,GG,(j)+3,W[(j)+3],W[(j)+3]^W[(j)+7])
+
+static void sm3_compress_unrolled(uint32_t V[8], const uint8_t block[64]){
+    uint32_t W[68];
+    for(int i=0;i<16;++i){
+        W[i] = (uint32_t)block[i*4]<<24 | (uint32_t)block[i*4+1]<<16 |
+                (uint32_t)block[i*4+2]<<8  | (uint32_t)block[i*4+3];
+    }
+    for(int i=16;i<68;++i) W[i] = P1(W[i-16]^W[i-9]^rotl32(W[i-3],15))^rotl32(W[i-13],7)^W[i-6];
+    uint32_t A=V[0],B=V[1],C=V[2],D=V[3],E=V[4],F=V[5],G=V[6],H=V[7];
+    SM3_RND4(FF00,GG00,0)  SM3_RND4(FF00,GG00,4)  SM3_RND4(FF00,GG00,8)  SM3_RND4(FF00,GG00,12)
+    SM3_RND4(FF16,GG16,16) SM3_RND4(FF16,GG16,20) SM3_RND4(FF16,GG16,24) SM3_RND4(FF16,GG16,28)
+    SM3_RND4(FF16,GG16,32) SM3_RND4(FF16,GG16,36) SM3_RND4(FF16,GG16,40) SM3_RND4(FF16,GG16,44)
+    SM3_RND4(FF16,GG16,48) SM3_RND4(FF16,GG16,52) SM3_RND4(FF16,GG16,56) SM3_RND4(FF16,GG16,60)
+    V[0]^=A; V[1]^=B; V[2]^=C; V[3]^=D; V[4]^=E; V[5]^=F; V[6]^=G; V[7]^=H;
+}
+#undef SM3_RND4
+
+// =============================================================================
+//  ── SSSE3 Single-stream Compression ──
+// =============================================================================
+//  For one long message (backups): the rounds of the unrolled kernel, but
+//  the message expansion runs four words at a time in an xmm register and
+//  is interleaved with the rounds, so the integer units do the rounds while
+//  the vector units compute W for later ones. Only a rolling window of 16
+//  words (X0..X3 = W[j..j+15]) is kept instead of W[68]/W′[64].
+#ifdef SM3_HAVE_X86
+SM3_TARGET_SSSE3 static inline __m128i rotl32_128(__m128i x, int n){
+    return _mm_or_si128(_mm_slli_epi32(x,n), _mm_srli_epi32(x,32-n));
+}
+SM3_TARGET_SSSE3 static inline __m128i P1_128(__m128i x){
+    return _mm_xor_si128(_mm_xor_si128(x, rotl32_128(x,15)), rotl32_128(x,23));
+}
+
+//  W[j+16..j+19] from the window X0..X3 = W[j..j+15]. W[j+19] needs
+//  W[j+16] from the same step, so lane 3 is first computed without it and
+//  then corrected: P1 is linear, so P1(t ^ (W[j+16] <<< 15)) =
+//  P1(t) ^ P1(W[j+16] <<< 15).
+SM3_TARGET_SSSE3 static inline __m128i sm3_expand4(__m128i X0, __m128i X1, __m128i X2, __m128i X3){
+    __m128i m13 = _mm_alignr_epi8(X1,X0,12);       // W[j+3..j+6]
+    __m128i m9  = _mm_alignr_epi8(X2,X1,12);       // W[j+7..j+10]
+    __m128i m6  = _mm_alignr_epi8(X3,X2,8);        // W[j+10..j+13]
+    __m128i m3  = _mm_srli_si128(X3,4);            // W[j+13..j+15], 0
+    __m128i t = _mm_xor_si128(_mm_xor_si128(X0,m9), rotl32_128(m3,15));
+    __m128i r = _mm_xor_si128(_mm_xor_si128(P1_128(t), rotl32_128(m13,7)), m6);
+    __m128i u = rotl32_128(_mm_slli_si128(r,12),15);
+    return _mm_xor_si128(r, P1_128(u));
+}
+
+#define SM3_RND4_WIN(FF,GG,j) \
+    SM3_RND(A,B,C,D,E,F,G,H,FF,GG,j,  w[0],wp[0]) \
+    SM3_RND(D,A,B,C,H,E,F,G,FF,GG,(j)+1,w[1],wp[1]) \
+    SM3_RND(C,D,A,B,G,H,E,F,FF,GG,(j)+2,w[2],wp[2]) \
+    SM3_RND(B,C,D,A,F,G,H,E,FF,GG,(j)+3,w[3],wp[3])
+//  Rounds j..j+3 take W = X0 and W′ = X0 ^ X1; the window then slides by
+//  four words. W[64..67] is the last word group needed, produced at j = 48.
+#define SM3_GROUP(FF,GG,j) {\
+    _mm_store_si128((__m128i*)w, X0);\
+    _mm_store_si128((__m128i*)wp, _mm_xor_si128(X0,X1));\
+    if((j)<=48){ __m128i R=sm3_expand4(X0,X1,X2,X3); X0=X1; X1=X2; X2=X3; X3=R; }\
+    else { X0=X1; X1=X2; X2=X3; }\
+    SM3_RND4_WIN(FF,GG,j) }
+
+SM3_TARGET_SSSE3 static void sm3_compress_ssse3(uint32_t V[8], const uint8_t block[64]){
+    const __m128i bswap = _mm_setr_epi8(3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12);
+    __m128i X0=_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block+0)), bswap);
+    __m128i X1=_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block+16)),bswap);
+    __m128i X2=_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block+32)),bswap);
+    __m128i X3=_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block+48)),bswap);
+    alignas(16) uint32_t w[4], wp[4];
+    uint32_t A=V[0],B=V[1],C=V[2],D=V[3],E=V[4],F=V[5],G=V[6],H=V[7];
+    SM3_GROUP(FF00,GG00,0)  SM3_GROUP(FF00,GG00,4)  SM3_GROUP(FF00,GG00,8)  SM3_GROUP(FF00,GG00,12)
+    SM3_GROUP(FF16,GG16,16) SM3_GROUP(FF16,GG16,20) SM3_GROUP(FF16,GG16,24) SM3_GROUP(FF16,GG16,28)
+    SM3_GROUP(FF16,GG16,32) SM3_GROUP(FF16,GG16,36) SM3_GROUP(FF16,GG16,40) SM3_GROUP(FF16,GG16,44)
+    SM3_GROUP(FF16,GG16,48) SM3_GROUP(FF16,GG16,52) SM3_GROUP(FF16,GG16,56) SM3_GROUP(FF16,GG16,60)
+    V[0]^=A; V[1]^=B; V[2]^=C; V[3]^=D; V[4]^=E; V[5]^=F; V[6]^=G; V[7]^=H;
+}
+#undef SM3_GROUP
+#undef SM3_RND4_WIN
+#endif // SM3_HAVE_X86
+#undef SM3_RND
+
 // =============================================================================
 //  ── AVX2 Eight-way Parallel Compression ──
 // =============================================================================
-#ifdef USE_AVX2
+#ifdef SM3_HAVE_X86
 //  Helpers for 32-bit rotate left on __m256i
-static inline __m256i rotl32_vec(__m256i x, int n){
+SM3_TARGET_AVX2 static inline __m256i rotl32_vec(__m256i x, int n){
     return _mm256_or_si256(_mm256_slli_epi32(x,n), _mm256_srli_epi32(x,32-n));
 }
-//  Load 8×32-bit big-endian words into lanes [0..7]
-static inline __m256i load_be256(const uint8_t *p){
-    __m256i t = _mm256_loadu_si256((const __m256i*)p); // little-endian bytes
-    // reverse bytes in each dword
-    const __m256i shuffle = _mm256_setr_epi8( 3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12,
-                                             19,18,17,16,23,22,21,20,27,26,25,24,31,30,29,28);
-    return _mm256_shuffle_epi8(t, shuffle);
+SM3_TARGET_AVX2 static inline __m256i P0_vec(__m256i x){ return _mm256_xor_si256(_mm256_xor_si256(x, rotl32_vec(x,9)), rotl32_vec(x,17)); }
+SM3_TARGET_AVX2 static inline __m256i P1_vec(__m256i x){ return _mm256_xor_si256(_mm256_xor_si256(x, rotl32_vec(x,15)), rotl32_vec(x,23)); }
+SM3_TARGET_AVX2 static inline __m256i FF16_vec(__m256i a, __m256i b, __m256i c){
+    return _mm256_or_si256(_mm256_and_si256(a,b), _mm256_and_si256(_mm256_or_si256(a,b),c));
+}
+SM3_TARGET_AVX2 static inline __m256i GG16_vec(__m256i e, __m256i f, __m256i g){
+    return _mm256_or_si256(_mm256_and_si256(e,f), _mm256_andnot_si256(e,g));
 }
 
-static void sm3_compress_avx2(uint32_t V[8*8] RESTRICT, const uint8_t * RESTRICT blocks){
-    // V: 8 parallel states concatenated (A0..H0, A1..H1, ... A7..H7)
-    // blocks: 8×64-byte consecutive message blocks
+//  Load words [w, w+8) of the 8 lane blocks and transpose them, so that
+//  W[w+k] holds word w+k of lane 0..7 (big-endian converted).
+SM3_TARGET_AVX2 static inline void load_transpose8(__m256i *W, const uint8_t *const blocks[8], int w){
+    const __m256i bswap = _mm256_setr_epi8( 3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12,
+                                           3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12);
+    __m256i r[8], t[8], u[8];
+    for(int l=0;l<8;++l) r[l]=_mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(blocks[l]+w*4)), bswap);
+    for(int l=0;l<8;l+=2){
+        t[l]  =_mm256_unpacklo_epi32(r[l],r[l+1]);   // l:w0 l+1:w0 l:w1 l+1:w1 | w4,w5
+        t[l+1]=_mm256_unpackhi_epi32(r[l],r[l+1]);   // w2,w3 | w6,w7
+    }
+    for(int l=0;l<8;l+=4){
+        u[l]  =_mm256_unpacklo_epi64(t[l],  t[l+2]); // w0 of 4 lanes | w4
+        u[l+1]=_mm256_unpackhi_epi64(t[l],  t[l+2]); // w1 | w5
+        u[l+2]=_mm256_unpacklo_epi64(t[l+1],t[l+3]); // w2 | w6
+        u[l+3]=_mm256_unpackhi_epi64(t[l+1],t[l+3]); // w3 | w7
+    }
+    for(int k=0;k<4;++k){
+        W[w+k]  =_mm256_permute2x128_si256(u[k],u[k+4],0x20);
+        W[w+k+4]=_mm256_permute2x128_si256(u[k],u[k+4],0x31);
+    }
+}
+
+SM3_TARGET_AVX2 static void sm3_compress_avx2(uint32_t * RESTRICT V, const uint8_t *const blocks[8]){
+    // V: 8 parallel states, word-major (A0..A7, B0..B7, ... H0..H7)
+    // blocks: one 64-byte block per lane, independent pointers
     __m256i A,B,C,D,E,F,G,H;
-    // Load states
     A=_mm256_loadu_si256((const __m256i*)(V+0));  // A0..A7
     B=_mm256_loadu_si256((const __m256i*)(V+8));
     C=_mm256_loadu_si256((const __m256i*)(V+16));
@@ -114,32 +243,34 @@ static void sm3_compress_avx2(uint32_t V[8*8] RESTRICT, const uint8_t * RESTRICT
     G=_mm256_loadu_si256((const __m256i*)(V+48));
     H=_mm256_loadu_si256((const __m256i*)(V+56));
 
-    __m256i W[68]; __m256i Wp;
-    // 1) load first 16 words
-    for(int i=0;i<16;++i){
-        W[i]= load_be256(blocks + i*4*8); // interleaved blocks
-    }
+    __m256i W[68];
+    // 1) load first 16 words of every lane
+    load_transpose8(W, blocks, 0);
+    load_transpose8(W, blocks, 8);
     // 2) expand W 16..67
     for(int i=16;i<68;++i){
         __m256i tmp = _mm256_xor_si256(_mm256_xor_si256(W[i-16], W[i-9]), rotl32_vec(W[i-3],15));
-        W[i] = _mm256_xor_si256(_mm256_xor_si256(P1(tmp), rotl32_vec(W[i-13],7)), W[i-6]);
+        W[i] = _mm256_xor_si256(_mm256_xor_si256(P1_vec(tmp), rotl32_vec(W[i-13],7)), W[i-6]);
     }
-    // Precompute W′ in-place later using XOR on the fly
+    // W′ is formed on the fly
     for(int j=0;j<64;++j){
-        __m256i TJ = _mm256_set1_epi32(TJROT32[j]);
-        __m256i SS1 = rotl32_vec(_mm256_add_epi32(_mm256_add_epi32(rotl32_vec(A,12),E),TJ),7);
-        __m256i SS2 = _mm256_xor_si256(SS1, rotl32_vec(A,12));
-        Wp = _mm256_xor_si256(W[j], W[j+4]);
-        __m256i TT1, TT2;
+        __m256i TJ = _mm256_set1_epi32((int)TJROT32[j]);
+        __m256i A12 = rotl32_vec(A,12);
+        __m256i SS1 = rotl32_vec(_mm256_add_epi32(_mm256_add_epi32(A12,E),TJ),7);
+        __m256i SS2 = _mm256_xor_si256(SS1, A12);
+        __m256i Wp = _mm256_xor_si256(W[j], W[j+4]);
+        __m256i FF, GG;
         if(j<16){
-            TT1 = _mm256_add_epi32(_mm256_add_epi32(_mm256_add_epi32(FF00(A,B,C),D),SS2),Wp);
-            TT2 = _mm256_add_epi32(_mm256_add_epi32(_mm256_add_epi32(GG00(E,F,G),H),SS1),W[j]);
+            FF = _mm256_xor_si256(_mm256_xor_si256(A,B),C);
+            GG = _mm256_xor_si256(_mm256_xor_si256(E,F),G);
         }else{
-            TT1 = _mm256_add_epi32(_mm256_add_epi32(_mm256_add_epi32(FF16(A,B,C),D),SS2),Wp);
-            TT2 = _mm256_add_epi32(_mm256_add_epi32(_mm256_add_epi32(GG16(E,F,G),H),SS1),W[j]);
+            FF = FF16_vec(A,B,C);
+            GG = GG16_vec(E,F,G);
         }
+        __m256i TT1 = _mm256_add_epi32(_mm256_add_epi32(_mm256_add_epi32(FF,D),SS2),Wp);
+        __m256i TT2 = _mm256_add_epi32(_mm256_add_epi32(_mm256_add_epi32(GG,H),SS1),W[j]);
         D=C; C=rotl32_vec(B,9); B=A; A=TT1;
-        H=G; G=rotl32_vec(F,19); F=E; E=P0(TT2);
+        H=G; G=rotl32_vec(F,19); F=E; E=P0_vec(TT2);
     }
     // Feed-forward
     A=_mm256_xor_si256(A, _mm256_loadu_si256((const __m256i*)(V+0)));
@@ -157,36 +288,289 @@ static void sm3_compress_avx2(uint32_t V[8*8] RESTRICT, const uint8_t * RESTRICT
     _mm256_storeu_si256((__m256i*)(V+32),E); _mm256_storeu_si256((__m256i*)(V+40),F);
     _mm256_storeu_si256((__m256i*)(V+48),G); _mm256_storeu_si256((__m256i*)(V+56),H);
 }
-#endif // USE_AVX2
+#endif // SM3_HAVE_X86
 
 // =============================================================================
-//  Public API (unchanged)
+//  ── AVX-512 Sixteen-way Parallel Compression ──
 // =============================================================================
+//  Same layout as the AVX2 kernel with 16 lanes. Rotates are single vprold
+//  and every three-input boolean (FF, GG, P0, P1, the W expansion) is one
+//  vpternlogd: 0x96 = a^b^c, 0xE8 = majority, 0xCA = a?b:c.
+#ifdef SM3_HAVE_X86
+#define XOR3_512(a,b,c) _mm512_ternarylogic_epi32((a),(b),(c),0x96)
+SM3_TARGET_AVX512 static inline __m512i P0_512(__m512i x){ return XOR3_512(x, _mm512_rol_epi32(x,9),  _mm512_rol_epi32(x,17)); }
+SM3_TARGET_AVX512 static inline __m512i P1_512(__m512i x){ return XOR3_512(x, _mm512_rol_epi32(x,15), _mm512_rol_epi32(x,23)); }
+
+//  Whole 64-byte block of each of the 16 lanes -> W[0..15], 16x16 dword
+//  transpose: two unpack stages inside 128-bit lanes, then a 4x4 transpose
+//  of the 128-bit lanes with vshufi32x4.
+SM3_TARGET_AVX512 static inline void load_transpose16(__m512i *W, const uint8_t *const blocks[16]){
+    const __m512i bswap = _mm512_set4_epi32(0x0C0D0E0F,0x08090A0B,0x04050607,0x00010203);
+    __m512i r[16], t[16], u[16];
+    for(int l=0;l<16;++l) r[l]=_mm512_shuffle_epi8(_mm512_loadu_si512((const void*)blocks[l]), bswap);
+    for(int l=0;l<16;l+=2){
+        t[l]  =_mm512_unpacklo_epi32(r[l],r[l+1]);
+        t[l+1]=_mm512_unpackhi_epi32(r[l],r[l+1]);
+    }
+    for(int g=0;g<16;g+=4){                          // u[g+k], 128-bit lane q: word 4q+k of rows g..g+3
+        u[g]  =_mm512_unpacklo_epi64(t[g],  t[g+2]);
+        u[g+1]=_mm512_unpackhi_epi64(t[g],  t[g+2]);
+        u[g+2]=_mm512_unpacklo_epi64(t[g+1],t[g+3]);
+        u[g+3]=_mm512_unpackhi_epi64(t[g+1],t[g+3]);
+    }
+    for(int k=0;k<4;++k){
+        __m512i s0=_mm512_shuffle_i32x4(u[k],  u[4+k], 0x44), s1=_mm512_shuffle_i32x4(u[k],  u[4+k], 0xEE);
+        __m512i s2=_mm512_shuffle_i32x4(u[8+k],u[12+k],0x44), s3=_mm512_shuffle_i32x4(u[8+k],u[12+k],0xEE);
+        W[k]   =_mm512_shuffle_i32x4(s0,s2,0x88);
+        W[4+k] =_mm512_shuffle_i32x4(s0,s2,0xDD);
+        W[8+k] =_mm512_shuffle_i32x4(s1,s3,0x88);
+        W[12+k]=_mm512_shuffle_i32x4(s1,s3,0xDD);
+    }
+}
+
+SM3_TARGET_AVX512 static void sm3_compress_avx512(uint32_t * RESTRICT V, const uint8_t *const blocks[16]){
+    // V: 16 parallel states, word-major (A0..A15, B0..B15, ... H0..H15)
+    __m512i S[8], X[8];
+    for(int w=0;w<8;++w) S[w]=X[w]=_mm512_loadu_si512((const void*)(V+16*w));
+    __m512i &A=X[0],&B=X[1],&C=X[2],&D=X[3],&E=X[4],&F=X[5],&G=X[6],&H=X[7];
+
+    __m512i W[68];
+    load_transpose16(W, blocks);
+    for(int i=16;i<68;++i){
+        __m512i tmp = XOR3_512(W[i-16], W[i-9], _mm512_rol_epi32(W[i-3],15));
+        W[i] = XOR3_512(P1_512(tmp), _mm512_rol_epi32(W[i-13],7), W[i-6]);
+    }
+    for(int j=0;j<64;++j){
+        __m512i A12 = _mm512_rol_epi32(A,12);
+        __m512i SS1 = _mm512_rol_epi32(_mm512_add_epi32(_mm512_add_epi32(A12,E),_mm512_set1_epi32((int)TJROT32[j])),7);
+        __m512i SS2 = _mm512_xor_si512(SS1, A12);
+        __m512i Wp = _mm512_xor_si512(W[j], W[j+4]);
+        __m512i FF = (j<16) ? XOR3_512(A,B,C) : _mm512_ternarylogic_epi32(A,B,C,0xE8);
+        __m512i GG = (j<16) ? XOR3_512(E,F,G) : _mm512_ternarylogic_epi32(E,F,G,0xCA);
+        __m512i TT1 = _mm512_add_epi32(_mm512_add_epi32(_mm512_add_epi32(FF,D),SS2),Wp);
+        __m512i TT2 = _mm512_add_epi32(_mm512_add_epi32(_mm512_add_epi32(GG,H),SS1),W[j]);
+        D=C; C=_mm512_rol_epi32(B,9); B=A; A=TT1;
+        H=G; G=_mm512_rol_epi32(F,19); F=E; E=P0_512(TT2);
+    }
+    for(int w=0;w<8;++w) _mm512_storeu_si512((void*)(V+16*w), _mm512_xor_si512(X[w],S[w]));
+}
+#undef XOR3_512
+#endif // SM3_HAVE_X86
+
+// =============================================================================
+//  ── Multi-buffer lanes ──
+// =============================================================================
+//  Each SIMD lane walks one message: its full blocks are read in place, the
+//  last one or two blocks (tail + padding) come from a per-lane buffer. A
+//  lane that finishes is refilled with the next message at once, so unequal
+//  lengths do not leave lanes idle while work remains.
+struct SM3_Lane{
+    size_t msg;                 // index into msgs
+    const uint8_t *p;           // next full block of the message
+    size_t full;                // full blocks left in the message
+    size_t tail_blocks, tail_used;
+    alignas(32) uint8_t tail[128];
+};
+
+//  skip: bytes already compressed into the lane's start state (a block-aligned
+//  midstate), counted in the length field.
+static void sm3_lane_start(SM3_Lane *L, size_t m, const uint8_t *msg, size_t len, uint64_t skip=0){
+    L->msg=m; L->p=msg; L->full=len/64;
+    size_t rem=len%64;
+    L->tail_blocks=(rem<56)?1:2; L->tail_used=0;
+    std::memset(L->tail,0,sizeof(L->tail));
+    if(rem) std::memcpy(L->tail,msg+len-rem,rem);
+    L->tail[rem]=0x80;
+    uint64_t bits=(skip+len)<<3; uint8_t *end=L->tail+L->tail_blocks*64;
+    for(int i=0;i<8;++i) end[i-8]=(uint8_t)(bits>>(56-8*i));
+}
+static inline bool sm3_lane_done(const SM3_Lane *L){ return L->full==0 && L->tail_used==L->tail_blocks; }
+static inline const uint8_t *sm3_lane_next(SM3_Lane *L){
+    if(L->full){ const uint8_t *b=L->p; L->p+=64; --L->full; return b; }
+    return L->tail + 64*(L->tail_used++);
+}
+static inline void sm3_store_digest(uint8_t out[32], const uint32_t s[8]){
+    for(int i=0;i<8;++i){ out[i*4]=(uint8_t)(s[i]>>24); out[i*4+1]=(uint8_t)(s[i]>>16); out[i*4+2]=(uint8_t)(s[i]>>8); out[i*4+3]=(uint8_t)s[i]; }
+}
+typedef void (*SM3_CompressFn)(uint32_t V[8], const uint8_t block[64]);
+
+static void sm3_lane_finish(SM3_Lane *L, uint32_t s[8], uint8_t *digests, SM3_CompressFn compress){
+    while(!sm3_lane_done(L)) compress(s, sm3_lane_next(L));
+    sm3_store_digest(digests+32*L->msg, s);
+}
+
+//  Scheduler shared by the SIMD kernels. V is word-major with stride LANES.
+//  A batch pays for all LANES, so once fewer than LANES/4+1 messages are left
+//  the rest go to the single-message kernel. Every lane starts from init
+//  after `skip` bytes (IV and 0 for plain SM3).
+template<int LANES, void (*COMPRESS)(uint32_t *, const uint8_t *const *)>
+static void sm3_hash_many_simd(const uint8_t *const *msgs, const size_t *lens, uint8_t *digests, size_t n,
+                               SM3_CompressFn single, const uint32_t init[8]=IV, uint64_t skip=0){
+    const int min_active=LANES/4+1;
+    SM3_Lane lane[LANES]; bool busy[LANES]={false};
+    alignas(64) uint32_t V[8*LANES];
+    static const uint8_t idle_block[64]={0};
+    const uint8_t *blk[LANES];
+    size_t next=0; int active=0;
+    auto refill=[&](int l){
+        if(next<n){
+            sm3_lane_start(&lane[l], next, msgs[next], lens[next], skip); ++next;
+            for(int w=0;w<8;++w) V[w*LANES+l]=init[w];
+            if(!busy[l]){ busy[l]=true; ++active; }
+        }else if(busy[l]){ busy[l]=false; --active; }
+    };
+    for(int l=0;l<LANES;++l) refill(l);
+    while(active>=min_active){
+        for(int l=0;l<LANES;++l) blk[l]=busy[l]?sm3_lane_next(&lane[l]):idle_block;
+        COMPRESS(V, blk);
+        for(int l=0;l<LANES;++l){
+            if(!busy[l] || !sm3_lane_done(&lane[l])) continue;
+            uint32_t s[8];
+            for(int w=0;w<8;++w) s[w]=V[w*LANES+l];
+            sm3_store_digest(digests+32*lane[l].msg, s);
+            refill(l);
+        }
+    }
+    // next == n here: only the last few messages remain in their lanes
+    for(int l=0;l<LANES;++l){
+        if(!busy[l]) continue;
+        uint32_t s[8];
+        for(int w=0;w<8;++w) s[w]=V[w*LANES+l];
+        sm3_lane_finish(&lane[l], s, digests, single);
+    }
+}
+
+// =============================================================================
+//  ── Runtime dispatch ──
+// =============================================================================
+//  Probed once: CPU features via CPUID (__builtin_cpu_supports also checks
+//  that the OS saves the ymm/zmm state), then every candidate has to
+//  reproduce the standard test vectors before it can be selected, so a
+//  kernel that computes wrong digests is never used.
+enum SM3_Backend{ SM3_BACKEND_SCALAR, SM3_BACKEND_UNROLLED, SM3_BACKEND_SSSE3, SM3_BACKEND_AVX2, SM3_BACKEND_AVX512, SM3_BACKEND_COUNT };
+
+static inline const char *sm3_backend_name(SM3_Backend b){
+    switch(b){
+    case SM3_BACKEND_UNROLLED: return "unrolled";
+    case SM3_BACKEND_SSSE3:    return "SSSE3";
+    case SM3_BACKEND_AVX2:     return "AVX2 8-lane";
+    case SM3_BACKEND_AVX512:   return "AVX-512 16-lane";
+    default:                   return "scalar";
+    }
+}
+
+static SM3_CompressFn sm3_single_fn(SM3_Backend b){
+    switch(b){
+    case SM3_BACKEND_UNROLLED: return sm3_compress_unrolled;
+#ifdef SM3_HAVE_X86
+    case SM3_BACKEND_SSSE3:    return sm3_compress_ssse3;
+#endif
+    default:                   return sm3_compress_scalar;
+    }
+}
+
+//  GB/T 32905-2016 appendix A: "abc" and "abcd" x 16. The batch alternates
+//  them so neighbouring lanes hold different messages and block counts.
+static bool sm3_self_test(SM3_Backend b){
+    static const uint8_t kat_abc[32]={
+        0x66,0xC7,0xF0,0xF4,0x62,0xEE,0xED,0xD9,0xD1,0xF2,0xD4,0x6B,0xDC,0x10,0xE4,0xE2,
+        0x41,0x67,0xC4,0x87,0x5C,0xF2,0xF7,0xA2,0x29,0x7D,0xA0,0x2B,0x8F,0x4B,0xA8,0xE0};
+    static const uint8_t kat_abcd16[32]={
+        0xDE,0xBE,0x9F,0xF9,0x22,0x75,0xB8,0xA1,0x38,0x60,0x48,0x89,0xC1,0x8E,0x5A,0x4D,
+        0x6F,0xDB,0x70,0xE5,0x38,0x7E,0x57,0x65,0x29,0x3D,0xCB,0xA3,0x9C,0x0C,0x57,0x32};
+    uint8_t abcd16[64];
+    for(int i=0;i<64;++i) abcd16[i]=(uint8_t)("abcd"[i%4]);
+    const size_t n=40;
+    const uint8_t *msgs[n]; size_t lens[n]; uint8_t dig[32*n];
+    for(size_t i=0;i<n;++i){ msgs[i]=(i&1)?abcd16:(const uint8_t*)"abc"; lens[i]=(i&1)?64:3; }
+    switch(b){
+#ifdef SM3_HAVE_X86
+    case SM3_BACKEND_AVX2:   sm3_hash_many_simd<8,  sm3_compress_avx2>(msgs, lens, dig, n, sm3_compress_scalar); break;
+    case SM3_BACKEND_AVX512: sm3_hash_many_simd<16, sm3_compress_avx512>(msgs, lens, dig, n, sm3_compress_scalar); break;
+#endif
+    default:
+        for(size_t i=0;i<n;++i){
+            SM3_Lane L; uint32_t st[8];
+            sm3_lane_start(&L, i, msgs[i], lens[i]);
+            std::memcpy(st,IV,32);
+            sm3_lane_finish(&L, st, dig, sm3_single_fn(b));
+        }
+    }
+    for(size_t i=0;i<n;++i){
+        if(std::memcmp(dig+32*i, (i&1)?kat_abcd16:kat_abc, 32)!=0) return false;
+    }
+    return true;
+}
+
+struct SM3_Probe{ bool ok[SM3_BACKEND_COUNT]; SM3_Backend best; };
+
+static const SM3_Probe &sm3_probe(){
+    static const SM3_Probe probe=[]{
+        SM3_Probe p={};
+        p.ok[SM3_BACKEND_SCALAR]=sm3_self_test(SM3_BACKEND_SCALAR);
+        p.ok[SM3_BACKEND_UNROLLED]=sm3_self_test(SM3_BACKEND_UNROLLED);
+#ifdef SM3_HAVE_X86
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("ssse3")) p.ok[SM3_BACKEND_SSSE3]=sm3_self_test(SM3_BACKEND_SSSE3);
+        if(__builtin_cpu_supports("avx2")) p.ok[SM3_BACKEND_AVX2]=sm3_self_test(SM3_BACKEND_AVX2);
+        if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+            p.ok[SM3_BACKEND_AVX512]=sm3_self_test(SM3_BACKEND_AVX512);
+#endif
+        // the reference kernel stays the last resort even if it failed
+        p.best=SM3_BACKEND_SCALAR;
+        const SM3_Backend order[]={ SM3_BACKEND_AVX512, SM3_BACKEND_AVX2, SM3_BACKEND_SSSE3, SM3_BACKEND_UNROLLED };
+        for(SM3_Backend b:order) if(p.ok[b]){ p.best=b; break; }
+        return p;
+    }();
+    return probe;
+}
+
+//  true if the host runs backend b and it passed its self-test
+static bool sm3_backend_available(SM3_Backend b){
+    return b>=0 && b<SM3_BACKEND_COUNT && sm3_probe().ok[b];
+}
+
+static std::atomic<int> &sm3_active(){
+    static std::atomic<int> active{ sm3_probe().best };
+    return active;
+}
+
+static SM3_Backend sm3_backend(){ return (SM3_Backend)sm3_active().load(std::memory_order_relaxed); }
+
+//  Forces backend b (benchmarks, tests); false if it is not available.
+static inline bool sm3_set_backend(SM3_Backend b){
+    if(!sm3_backend_available(b)) return false;
+    sm3_active().store(b, std::memory_order_relaxed);
+    return true;
+}
+
+//  Kernel for one message: the multi-buffer backends process a single
+//  stream with the best single-stream kernel that passed.
+static SM3_CompressFn sm3_single_kernel(){
+    SM3_Backend b=sm3_backend();
+    if(b>=SM3_BACKEND_SSSE3){
+        const SM3_Probe &p=sm3_probe();
+        b=p.ok[SM3_BACKEND_SSSE3]?SM3_BACKEND_SSSE3:p.ok[SM3_BACKEND_UNROLLED]?SM3_BACKEND_UNROLLED:SM3_BACKEND_SCALAR;
+    }
+    return sm3_single_fn(b);
+}
+
+// =============================================================================
+//  Public API (single message)
+// =============================================================================
+//  One message has a serial dependency between blocks, so it always runs on
+//  a single-message kernel; SIMD lanes are only filled by sm3_hash_many().
 static void sm3_init(SM3_CTX *ctx){ std::memcpy(ctx->state,IV,32); ctx->bitlen=0; }
 
 static void sm3_update(SM3_CTX *ctx,const uint8_t * RESTRICT data,size_t len){
     size_t idx=(ctx->bitlen>>3)&0x3F; ctx->bitlen += (uint64_t)len<<3;
     size_t part=64-idx; size_t i=0;
 
+    SM3_CompressFn compress=sm3_single_kernel();
+
     // Finish partial block first
-    if(idx && len>=part){ std::memcpy(ctx->buffer+idx,data,part); sm3_compress_scalar(ctx->state,ctx->buffer); i+=part; idx=0; }
-
-#ifdef USE_AVX2
-    // Process 8-block batches using AVX2 when possible
-    for(; i+512<=len; i+=512){
-        // Copy current state into 8 parallel lanes (Ao..Ho etc.)
-        alignas(32) uint32_t v8[64];
-        for(int lane=0; lane<8; ++lane) std::memcpy(v8+lane*8, ctx->state, 32);
-        sm3_compress_avx2(v8, data+i);
-        // XOR-reduce lanes back into ctx->state
-        for(int word=0; word<8; ++word){
-            uint32_t acc=0; for(int lane=0; lane<8; ++lane) acc ^= v8[lane*8+word];
-            ctx->state[word]=acc;
-        }
-    }
-#endif
-    // Scalar remainder blocks
-    for(; i+64<=len; i+=64) sm3_compress_scalar(ctx->state,data+i);
+    if(idx && len>=part){ std::memcpy(ctx->buffer+idx,data,part); compress(ctx->state,ctx->buffer); i+=part; idx=0; }
+    for(; i+64<=len; i+=64) compress(ctx->state,data+i);
     if(i<len) std::memcpy(ctx->buffer+idx,data+i,len-i);
 }
 
@@ -195,4 +579,177 @@ static void sm3_final(SM3_CTX *ctx, uint8_t out[32]){
     for(int i=0;i<8;++i) len_be[i]=(ctx->bitlen>>(56-8*i))&0xFF;
     size_t idx=(ctx->bitlen>>3)&0x3F; size_t padlen=(idx<56)?(56-idx):(120-idx);
     sm3_update(ctx,pad,padlen); sm3_update(ctx,len_be,8);
-    for(int i
\ No newline at end of file
+    for(int i=0;i<8;++i){ out[i*4]=(ctx->state[i]>>24)&0xFF; out[i*4+1]=(ctx->state[i]>>16)&0xFF; out[i*4+2]=(ctx->state[i]>>8)&0xFF; out[i*4+3]=ctx->state[i]&0xFF; }
+}
+
+// =============================================================================
+//  ── Multi-buffer API: n independent messages ──
+// =============================================================================
+//  digests receives 32*n bytes.
+
+//  Most lanes of any kernel; batch callers (1g.cpp) group this many
+//  messages per call, narrower kernels take them through lane refills.
+#define SM3_MB_LANES 16
+
+//  Every message continues from state `init` after `skip` bytes (a multiple
+//  of 64), see sm3_prefix_hash_many().
+static void sm3_hash_many_from(const uint32_t init[8], uint64_t skip,
+                               const uint8_t *const *msgs, const size_t *lens, uint8_t *digests, size_t n){
+    SM3_CompressFn single=sm3_single_kernel();
+    switch(sm3_backend()){
+#ifdef SM3_HAVE_X86
+    case SM3_BACKEND_AVX512:
+        if(n>=16/4+1){ sm3_hash_many_simd<16, sm3_compress_avx512>(msgs, lens, digests, n, single, init, skip); return; }
+        break;
+    case SM3_BACKEND_AVX2:
+        if(n>=8/4+1){ sm3_hash_many_simd<8, sm3_compress_avx2>(msgs, lens, digests, n, single, init, skip); return; }
+        break;
+#endif
+    default: break;
+    }
+    for(size_t i=0;i<n;++i){
+        SM3_Lane L; uint32_t s[8];
+        sm3_lane_start(&L, i, msgs[i], lens[i], skip);
+        std::memcpy(s,init,32);
+        sm3_lane_finish(&L, s, digests, single);
+    }
+}
+
+static inline void sm3_hash_many(const uint8_t *const *msgs, const size_t *lens, uint8_t *digests, size_t n){
+    sm3_hash_many_from(IV, 0, msgs, lens, digests, n);
+}
+
+// =============================================================================
+//  ── Midstate export / import ──
+// =============================================================================
+//  A context serialized after some prefix: the 8 state words and the bit
+//  length big-endian, then the partial block (only the first bitlen/8 % 64
+//  bytes count, the rest is zero). Importing it and hashing the remainder
+//  gives the digest of prefix || remainder.
+#define SM3_MIDSTATE_BYTES 104
+
+static inline void sm3_export(const SM3_CTX *ctx, uint8_t out[SM3_MIDSTATE_BYTES]){
+    sm3_store_digest(out, ctx->state);
+    for(int i=0;i<8;++i) out[32+i]=(uint8_t)(ctx->bitlen>>(56-8*i));
+    size_t idx=(ctx->bitlen>>3)&0x3F;
+    std::memcpy(out+40, ctx->buffer, idx);
+    std::memset(out+40+idx, 0, 64-idx);
+}
+
+//  false (ctx untouched) if the bit length is not a whole number of bytes
+static inline bool sm3_import(SM3_CTX *ctx, const uint8_t in[SM3_MIDSTATE_BYTES]){
+    uint64_t bits=0;
+    for(int i=0;i<8;++i) bits=bits<<8|in[32+i];
+    if(bits&7) return false;
+    for(int i=0;i<8;++i) ctx->state[i]=(uint32_t)in[i*4]<<24|(uint32_t)in[i*4+1]<<16|(uint32_t)in[i*4+2]<<8|in[i*4+3];
+    ctx->bitlen=bits;
+    std::memcpy(ctx->buffer, in+40, 64);
+    return true;
+}
+
+//  Continues from a published digest as if `len` bytes had been hashed; len
+//  is the padded length of the original message, so a multiple of 64 (false
+//  otherwise). This is the length-extension view of SM3 used by 4.b.cpp.
+static inline bool sm3_resume(SM3_CTX *ctx, const uint8_t digest[32], uint64_t len){
+    if(len%64) return false;
+    for(int i=0;i<8;++i) ctx->state[i]=(uint32_t)digest[i*4]<<24|(uint32_t)digest[i*4+1]<<16|(uint32_t)digest[i*4+2]<<8|digest[i*4+3];
+    ctx->bitlen=len<<3;
+    return true;
+}
+
+// =============================================================================
+//  ── Prefix cache ──
+// =============================================================================
+//  Messages that share a prefix (keyed records, "leaf#i" Merkle leaves) start
+//  from the midstate after it instead of hashing the prefix again. Only the
+//  prefix's whole 64-byte blocks are saved; its last partial block is copied
+//  in front of every message.
+struct SM3_PrefixCache{ SM3_CTX mid; };
+
+static inline void sm3_prefix_init(SM3_PrefixCache *pc, const uint8_t *prefix, size_t len){
+    sm3_init(&pc->mid); sm3_update(&pc->mid, prefix, len);
+}
+
+static inline void sm3_prefix_hash(const SM3_PrefixCache *pc, const uint8_t *msg, size_t len, uint8_t out[32]){
+    SM3_CTX ctx=pc->mid; sm3_update(&ctx, msg, len); sm3_final(&ctx, out);
+}
+
+//  Batch form through the multi-buffer lanes. A block-aligned prefix starts
+//  the lanes from its state directly; otherwise every message is rebuilt as
+//  partial block || msg in a scratch buffer, SM3_MB_LANES*4 at a time.
+static inline void sm3_prefix_hash_many(const SM3_PrefixCache *pc, const uint8_t *const *msgs, const size_t *lens,
+                                 uint8_t *digests, size_t n){
+    const size_t idx=(pc->mid.bitlen>>3)&0x3F;
+    const uint64_t skip=(pc->mid.bitlen>>3)-idx;
+    if(idx==0){ sm3_hash_many_from(pc->mid.state, skip, msgs, lens, digests, n); return; }
+    const size_t group=SM3_MB_LANES*4;
+    static thread_local std::vector<uint8_t> scratch;
+    const uint8_t *joined[group]; size_t jlens[group];
+    for(size_t b=0;b<n;b+=group){
+        size_t e=(b+group<n)?b+group:n, need=0;
+        for(size_t i=b;i<e;++i) need+=idx+lens[i];
+        if(need>scratch.size()) scratch.resize(need);
+        uint8_t *p=scratch.data();
+        for(size_t i=b;i<e;++i){
+            std::memcpy(p, pc->mid.buffer, idx); std::memcpy(p+idx, msgs[i], lens[i]);
+            joined[i-b]=p; jlens[i-b]=idx+lens[i]; p+=idx+lens[i];
+        }
+        sm3_hash_many_from(pc->mid.state, skip, joined, jlens, digests+32*b, e-b);
+    }
+}
+
+//  One-shot helper.
+static inline void sm3_hash(const uint8_t *data, size_t len, uint8_t out[32]){
+    SM3_CTX ctx; sm3_init(&ctx); sm3_update(&ctx, data, len); sm3_final(&ctx, out);
+}
+
+#ifdef SM3_TEST_MAIN
+#include <string>
+#include <chrono>
+int main(int argc,char *argv[]){ const char *msg=(argc>1)?argv[1]:"abc"; SM3_CTX ctx; uint8_t dig[32];
+    sm3_init(&ctx); sm3_update(&ctx,(const uint8_t*)msg,std::strlen(msg)); sm3_final(&ctx,dig);
+    for(uint8_t b:dig) std::printf("%02X",b);
+    std::printf("  %s\n",msg);
+
+    // Every available backend against the scalar reference: 1M records of
+    // mixed length (0..300 B, one- and two-block padding) through
+    // sm3_hash_many, and one 64 MB message through sm3_update.
+    const size_t N=1000000; std::vector<uint8_t> pool(N*8+300); std::vector<const uint8_t*> msgs(N); std::vector<size_t> lens(N);
+    for(size_t i=0;i<pool.size();++i) pool[i]=(uint8_t)(i*131+7);
+    for(size_t i=0;i<N;++i){ lens[i]=(i*2654435761u>>7)%301; msgs[i]=pool.data()+(i*8)%(pool.size()-300); }
+    std::vector<uint8_t> ref(32*N), out(32*N), big(64<<20); uint8_t big_ref[32];
+    for(size_t i=0;i<big.size();++i) big[i]=(uint8_t)(i>>5);
+    for(size_t i=0;i<N;++i){ SM3_CTX c; sm3_init(&c); sm3_update(&c,msgs[i],lens[i]); sm3_final(&c,&ref[32*i]); }
+    sm3_init(&ctx); sm3_update(&ctx,big.data(),big.size()); sm3_final(&ctx,big_ref);
+
+    const SM3_Backend selected=sm3_backend(); bool ok=true;
+    std::printf("selected backend: %s\n", sm3_backend_name(selected));
+    for(int b=0;b<SM3_BACKEND_COUNT;++b){
+        if(!sm3_set_backend((SM3_Backend)b)){ std::printf("%-16s unavailable\n", sm3_backend_name((SM3_Backend)b)); continue; }
+        auto t0=std::chrono::steady_clock::now();
+        sm3_hash_many(msgs.data(),lens.data(),out.data(),N);
+        auto t1=std::chrono::steady_clock::now();
+        sm3_init(&ctx); sm3_update(&ctx,big.data(),big.size()); sm3_final(&ctx,dig);
+        auto t2=std::chrono::steady_clock::now();
+        bool good=(ref==out) && std::memcmp(dig,big_ref,32)==0;
+        for(size_t n=0;n<=17 && good;++n){ sm3_hash_many(msgs.data()+100,lens.data()+100,out.data(),n); good=std::memcmp(out.data(),&ref[3200],32*n)==0; }
+        // prefix cache, block-aligned (64 B) and not (5 B, 100 B), against
+        // hashing prefix || msg from scratch; then an export/import round trip
+        for(size_t plen:{(size_t)64,(size_t)5,(size_t)100}){
+            SM3_PrefixCache pc; sm3_prefix_init(&pc, pool.data()+1000, plen);
+            sm3_prefix_hash_many(&pc, msgs.data(), lens.data(), out.data(), 200);
+            for(size_t i=0;i<200 && good;++i){
+                std::vector<uint8_t> cat(pool.data()+1000, pool.data()+1000+plen); cat.insert(cat.end(), msgs[i], msgs[i]+lens[i]);
+                sm3_hash(cat.data(), cat.size(), dig); good=std::memcmp(dig,&out[32*i],32)==0;
+            }
+            uint8_t ms[SM3_MIDSTATE_BYTES]; SM3_CTX c;
+            sm3_export(&pc.mid, ms); good&=sm3_import(&c, ms);
+            sm3_update(&c, msgs[7], lens[7]); sm3_final(&c, dig); good&=std::memcmp(dig,&out[32*7],32)==0;
+        }
+        double s1=std::chrono::duration<double>(t1-t0).count(), s2=std::chrono::duration<double>(t2-t1).count();
+        std::printf("%-16s %s  records: %.2f M/s  one 64 MB stream: %.0f MB/s\n", sm3_backend_name((SM3_Backend)b), good?"OK  ":"FAIL", N/s1/1e6, big.size()/s2/1e6);
+        ok&=good;
+    }
+    sm3_set_backend(selected);
+    return ok?0:1; }
+#endif
@@ -0,0 +1,183 @@
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include "4.a.4.cpp"
+
+// =============================================================================
+//  ── HMAC-SM3 with precomputed pad states ──
+// =============================================================================
+//  HMAC(K, m) = SM3((K0 ^ opad) || SM3((K0 ^ ipad) || m)), RFC 2104 with the
+//  64-byte SM3 block. K0 ^ ipad and K0 ^ opad are exactly one block each, so
+//  the key setup keeps the two midstates after them (SM3_PrefixCache) and a
+//  MAC only compresses the message blocks plus one outer block.
+//
+//  This is the repo's one HMAC-SM3: one-shot, streaming (init/update/final,
+//  used by the SM4-CTR + HMAC-SM3 stream in 1h.cpp) and batch.
+struct SM3_HmacKey{ SM3_PrefixCache inner, outer; };
+
+static inline void sm3_hmac_key(SM3_HmacKey *hk, const uint8_t *key, size_t len){
+    uint8_t k[64]={0}, pad[64];
+    if(len>64) sm3_hash(key, len, k); else if(len) std::memcpy(k, key, len);
+    for(int i=0;i<64;++i) pad[i]=k[i]^0x36;
+    sm3_prefix_init(&hk->inner, pad, 64);
+    for(int i=0;i<64;++i) pad[i]=k[i]^0x5c;
+    sm3_prefix_init(&hk->outer, pad, 64);
+    // the midstates are key material too; callers wipe the SM3_HmacKey
+    std::memset(k, 0, sizeof(k)); std::memset(pad, 0, sizeof(pad));
+}
+
+static inline void sm3_hmac(const SM3_HmacKey *hk, const uint8_t *msg, size_t len, uint8_t mac[32]){
+    uint8_t h[32];
+    sm3_prefix_hash(&hk->inner, msg, len, h);
+    sm3_prefix_hash(&hk->outer, h, 32, mac);
+}
+
+//  Streaming form for messages that arrive in pieces. The context copies
+//  both pad states, so the key may go away after sm3_hmac_init().
+struct SM3_HmacCtx{ SM3_CTX inner, outer; };
+
+static inline void sm3_hmac_init(SM3_HmacCtx *c, const SM3_HmacKey *hk){
+    c->inner=hk->inner.mid; c->outer=hk->outer.mid;
+}
+
+static inline void sm3_hmac_update(SM3_HmacCtx *c, const uint8_t *data, size_t len){
+    sm3_update(&c->inner, data, len);
+}
+
+static inline void sm3_hmac_final(SM3_HmacCtx *c, uint8_t mac[32]){
+    uint8_t h[32];
+    sm3_final(&c->inner, h);
+    sm3_update(&c->outer, h, 32);
+    sm3_final(&c->outer, mac);
+}
+
+//  Compares the whole tag regardless of where the first difference is.
+static inline bool sm3_hmac_equal(const uint8_t a[32], const uint8_t b[32]){
+    uint8_t d=0;
+    for(int i=0;i<32;++i) d|=a[i]^b[i];
+    return d==0;
+}
+
+static inline bool sm3_hmac_verify(const SM3_HmacKey *hk, const uint8_t *msg, size_t len, const uint8_t tag[32]){
+    uint8_t mac[32];
+    sm3_hmac(hk, msg, len, mac);
+    return sm3_hmac_equal(mac, tag);
+}
+
+// =============================================================================
+//  ── Batch MAC / verify ──
+// =============================================================================
+//  n messages under one key: the inner hashes go through the multi-buffer
+//  lanes from the ipad state, then their 32-byte digests through the lanes
+//  again from the opad state. macs receives 32*n bytes.
+#define SM3_HMAC_BATCH 256
+
+static inline void sm3_hmac_many(const SM3_HmacKey *hk, const uint8_t *const *msgs, const size_t *lens,
+                                 uint8_t *macs, size_t n){
+    uint8_t inner[32*SM3_HMAC_BATCH];
+    const uint8_t *ptr[SM3_HMAC_BATCH]; size_t len32[SM3_HMAC_BATCH];
+    for(size_t b=0;b<n;b+=SM3_HMAC_BATCH){
+        size_t m=(n-b<SM3_HMAC_BATCH)?n-b:SM3_HMAC_BATCH;
+        sm3_prefix_hash_many(&hk->inner, msgs+b, lens+b, inner, m);
+        for(size_t i=0;i<m;++i){ ptr[i]=inner+32*i; len32[i]=32; }
+        sm3_prefix_hash_many(&hk->outer, ptr, len32, macs+32*b, m);
+    }
+}
+
+//  ok[i] tells whether tags[32*i..] authenticates msgs[i]; returns how many do.
+static inline size_t sm3_hmac_verify_many(const SM3_HmacKey *hk, const uint8_t *const *msgs, const size_t *lens,
+                                          const uint8_t *tags, bool *ok, size_t n){
+    uint8_t macs[32*SM3_HMAC_BATCH]; size_t good=0;
+    for(size_t b=0;b<n;b+=SM3_HMAC_BATCH){
+        size_t m=(n-b<SM3_HMAC_BATCH)?n-b:SM3_HMAC_BATCH;
+        sm3_hmac_many(hk, msgs+b, lens+b, macs, m);
+        for(size_t i=0;i<m;++i){ ok[b+i]=sm3_hmac_equal(macs+32*i, tags+32*(b+i)); good+=ok[b+i]; }
+    }
+    return good;
+}
+
+#ifndef SM3_HMAC_NO_MAIN
+#include <vector>
+#include <chrono>
+
+//  RFC 2104 straight: both pad blocks hashed on every call.
+static void sm3_hmac_reference(const uint8_t *key, size_t klen, const uint8_t *msg, size_t len, uint8_t mac[32]){
+    uint8_t k[64]={0}, pad[64], h[32];
+    if(klen>64) sm3_hash(key, klen, k); else if(klen) std::memcpy(k, key, klen);
+    SM3_CTX c;
+    for(int i=0;i<64;++i) pad[i]=k[i]^0x36;
+    sm3_init(&c); sm3_update(&c, pad, 64); sm3_update(&c, msg, len); sm3_final(&c, h);
+    for(int i=0;i<64;++i) pad[i]=k[i]^0x5c;
+    sm3_init(&c); sm3_update(&c, pad, 64); sm3_update(&c, h, 32); sm3_final(&c, mac);
+}
+
+int main(){
+    bool ok=true;
+
+    // Known answers (cross-checked with OpenSSL): key "key" over "abc", and a
+    // 100-byte key (hashed first) with key[i] = 7i over msg[i] = 255 - i.
+    static const uint8_t kat_short[32]={
+        0x28,0xe6,0x32,0x56,0xe7,0xc5,0xa0,0x87,0xb1,0xf0,0x73,0x26,0x5d,0xc5,0x30,0x92,
+        0x16,0x3f,0x7b,0x82,0x72,0x97,0x35,0xd0,0x6f,0x28,0xf1,0x0a,0xf9,0xd5,0x23,0x93};
+    static const uint8_t kat_long[32]={
+        0x5d,0x87,0xa2,0x72,0x21,0xf8,0x66,0x05,0x97,0xd0,0x43,0x83,0x2f,0x03,0x57,0x6f,
+        0x13,0x3d,0xee,0x20,0x4d,0xee,0x60,0x64,0xcb,0x1a,0xa5,0x7f,0x8e,0x66,0x53,0x9a};
+    uint8_t long_key[100], long_msg[150], mac[32];
+    for(int i=0;i<100;++i) long_key[i]=(uint8_t)(i*7);
+    for(int i=0;i<150;++i) long_msg[i]=(uint8_t)(255-i);
+    SM3_HmacKey hk;
+    sm3_hmac_key(&hk, (const uint8_t*)"key", 3);
+    sm3_hmac(&hk, (const uint8_t*)"abc", 3, mac); ok&=std::memcmp(mac, kat_short, 32)==0;
+    sm3_hmac_key(&hk, long_key, sizeof(long_key));
+    sm3_hmac(&hk, long_msg, sizeof(long_msg), mac); ok&=std::memcmp(mac, kat_long, 32)==0;
+    // streamed in uneven pieces across block boundaries
+    for(size_t step:{(size_t)1,(size_t)7,(size_t)64,(size_t)65}){
+        SM3_HmacCtx c; sm3_hmac_init(&c, &hk);
+        for(size_t off=0;off<sizeof(long_msg);off+=step)
+            sm3_hmac_update(&c, long_msg+off, off+step<sizeof(long_msg)?step:sizeof(long_msg)-off);
+        sm3_hmac_final(&c, mac); ok&=std::memcmp(mac, kat_long, 32)==0;
+    }
+
+    // API tokens: 1M of 16..120 bytes under one 32-byte key, batch against
+    // the reference, then verify with every 7th tag corrupted.
+    const size_t N=1000000;
+    uint8_t api_key[32];
+    for(int i=0;i<32;++i) api_key[i]=(uint8_t)(0xA0+i);
+    sm3_hmac_key(&hk, api_key, sizeof(api_key));
+    std::vector<uint8_t> pool(N*8+128), ref(32*N), out(32*N);
+    std::vector<const uint8_t*> msgs(N); std::vector<size_t> lens(N);
+    for(size_t i=0;i<pool.size();++i) pool[i]=(uint8_t)(i*29+3);
+    for(size_t i=0;i<N;++i){ lens[i]=16+(i*2654435761u>>9)%105; msgs[i]=pool.data()+i*8; }
+
+    auto t0=std::chrono::steady_clock::now();
+    for(size_t i=0;i<N;++i) sm3_hmac_reference(api_key, sizeof(api_key), msgs[i], lens[i], &ref[32*i]);
+    auto t1=std::chrono::steady_clock::now();
+    for(size_t i=0;i<N;++i) sm3_hmac(&hk, msgs[i], lens[i], &out[32*i]);
+    auto t2=std::chrono::steady_clock::now();
+    ok&=ref==out;
+    sm3_hmac_many(&hk, msgs.data(), lens.data(), out.data(), N);
+    auto t3=std::chrono::steady_clock::now();
+    ok&=ref==out;
+
+    std::vector<uint8_t> tags(ref);
+    for(size_t i=0;i<N;i+=7) tags[32*i+(i%32)]^=0x01;
+    bool *good=new bool[N];
+    size_t passed=sm3_hmac_verify_many(&hk, msgs.data(), lens.data(), tags.data(), good, N);
+    auto t4=std::chrono::steady_clock::now();
+    ok&=passed==N-(N+6)/7;
+    for(size_t i=0;i<N;++i) ok&=good[i]==(i%7!=0);
+    ok&=sm3_hmac_verify(&hk, msgs[1], lens[1], &tags[32]) && !sm3_hmac_verify(&hk, msgs[0], lens[0], &tags[0]);
+    delete[] good;
+    std::memset(&hk, 0, sizeof(hk));
+
+    std::printf("HMAC-SM3 self-check: %s\n", ok?"OK":"FAIL");
+    auto rate=[&](std::chrono::steady_clock::time_point a, std::chrono::steady_clock::time_point b){
+        return N/std::chrono::duration<double>(b-a).count()/1e6; };
+    std::printf("backend: %s\n", sm3_backend_name(sm3_backend()));
+    std::printf("pads hashed per call:   %.2f M MAC/s\n", rate(t0,t1));
+    std::printf("precomputed pad states: %.2f M MAC/s\n", rate(t1,t2));
+    std::printf("batch MAC:              %.2f M MAC/s\n", rate(t2,t3));
+    std::printf("batch verify:           %.2f M tag/s\n", rate(t3,t4));
+    return ok?0:1;
+}
+#endif
@@ -3,9 +3,7 @@
 #include <cstring>
 #include <string>
 #include <vector>
-
-void sm3_hash(const uint8_t *msg, size_t len, uint8_t hash[32]);
-void sm3_compress(uint32_t digest[8], const uint8_t block[64]);
+#include "4.a.4.cpp"
 
 uint64_t pad_len(uint64_t msg_len) {
     uint64_t l = msg_len * 8;
@@ -46,29 +44,14 @@ int main() {
     print_digest("Original hash", H_orig);
 
     std::vector<uint8_t> glue = sm3_padding(secret.size());
-    std::vector<uint8_t> attack(glue);
-    attack.insert(attack.end(), suffix.begin(), suffix.end());
-
-    uint32_t IV[8];
-    for (int i = 0; i < 8; ++i)
-        IV[i] = (H_orig[i * 4] << 24) | (H_orig[i * 4 + 1] << 16) |
-                (H_orig[i * 4 + 2] << 8) | H_orig[i * 4 + 3];
-
-    uint64_t fake_len = secret.size() + glue.size();
-    std::vector<uint8_t> full = attack;
-    full.insert(full.end(), sm3_padding(fake_len + suffix.size()).begin(),
-                              sm3_padding(fake_len + suffix.size()).end());
-
-    for (size_t i = 0; i + 64 <= full.size(); i += 64)
-        sm3_compress(IV, full.data() + i);
 
+    // The attacker knows only H_orig and len(secret): resume from the digest
+    // as if secret || glue had been hashed, then append the suffix.
+    SM3_CTX ctx;
+    sm3_resume(&ctx, H_orig, secret.size() + glue.size());
+    sm3_update(&ctx, (const uint8_t*)suffix.data(), suffix.size());
     uint8_t forged[32];
-    for (int i = 0; i < 8; ++i) {
-        forged[i * 4 + 0] = IV[i] >> 24;
-        forged[i * 4 + 1] = IV[i] >> 16;
-        forged[i * 4 + 2] = IV[i] >> 8;
-        forged[i * 4 + 3] = IV[i];
-    }
+    sm3_final(&ctx, forged);
 
     print_digest("Forged hash", forged);
 
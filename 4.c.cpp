@@ -2,8 +2,11 @@
 #include <set>
 #include <chrono>
 #include <cassert>
+#include <string>
+#include <vector>
 
 #ifdef SM3_MERKLE_MAIN
+#include "4.a.4.cpp"
 
 using Hash = std::vector<uint8_t>;  // 32-byte digest
 
@@ -11,6 +14,22 @@ static Hash sm3(const std::string &msg) {
     Hash h(32); sm3_hash((const uint8_t*)msg.data(), msg.size(), h.data()); return h;
 }
 
+static std::string bytes_to_hex(const uint8_t *p, size_t n) {
+    static const char *hx = "0123456789abcdef";
+    std::string s;
+    for(size_t i = 0; i < n; ++i) s += hx[p[i] >> 4], s += hx[p[i] & 15];
+    return s;
+}
+
+// Every leaf is sm3("leaf#" + i), hashed a batch at a time through the
+// multi-buffer lanes. "leaf#" is shorter than a block, so the prefix cache
+// saves no compression here (it is copied in front of each id); the gain is
+// the batching alone.
+static const SM3_PrefixCache &leaf_prefix() {
+    static const SM3_PrefixCache pc = [] { SM3_PrefixCache p; sm3_prefix_init(&p, (const uint8_t*)"leaf#", 5); return p; }();
+    return pc;
+}
+
 static Hash sm3_concat(const Hash &a, const Hash &b) {
     Hash h(32); std::vector<uint8_t> data(a); data.insert(data.end(), b.begin(), b.end());
     sm3_hash(data.data(), data.size(), h.data()); return h;
@@ -24,9 +43,20 @@ public:
     Hash root;
 
     void build(size_t n) {
-        leaves.resize(n);
-        for(size_t i = 0; i < n; ++i)
-            leaves[i] = sm3("leaf#" + std::to_string(i));
+        leaves.assign(n, Hash(32));
+        const size_t batch = 1024;
+        std::vector<std::string> ids(batch);
+        const uint8_t *msgs[batch]; size_t lens[batch];
+        uint8_t dig[32 * batch];
+        for(size_t b = 0; b < n; b += batch) {
+            size_t m = (n - b < batch) ? n - b : batch;
+            for(size_t i = 0; i < m; ++i) {
+                ids[i] = std::to_string(b + i);
+                msgs[i] = (const uint8_t*)ids[i].data(); lens[i] = ids[i].size();
+            }
+            sm3_prefix_hash_many(&leaf_prefix(), msgs, lens, dig, m);
+            for(size_t i = 0; i < m; ++i) std::memcpy(leaves[b + i].data(), dig + 32 * i, 32);
+        }
         build_from_leaves();
     }
 
@@ -75,7 +105,8 @@ int main() {
     auto t0 = std::chrono::high_resolution_clock::now();
     tree.build(N);
     auto t1 = std::chrono::high_resolution_clock::now();
-    printf("Done. Root = %s\n", bytes_to_hex(tree.root.data(), 32).c_str());
+    printf("Done in %.1f ms. Root = %s\n", std::chrono::duration<double, std::milli>(t1 - t0).count(),
+           bytes_to_hex(tree.root.data(), 32).c_str());
 
     // Test existence proof
     size_t target = 12345;